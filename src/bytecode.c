@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "chunk.h"
+#include "memory.h"
+#include "vm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAP_BYTECODE
+#endif
+
+#define MAGIC_LENGTH 4
+#define WRITE "wb"
+#define READ "rb"
+
+// A .loxc file is the magic and version, the names of the globals its code
+// refers to by slot, then the script's function. Functions nest through
+// their constants. Integers are little-endian whatever the host.
+
+typedef enum {
+	CONSTANT_NUMBER,
+	CONSTANT_STRING,
+	CONSTANT_FUNCTION
+} ConstantTag;
+
+typedef struct sMapping {
+	uint8_t* data;
+	size_t size;
+	struct sMapping* next;
+} Mapping;
+
+static bool writeGlobals(FILE*);
+static void writeFunction(FILE*, ObjFunction*);
+static void readGlobals(Reader*);
+static ObjFunction* readFunction(Reader*);
+static void remapGlobals(Reader*, Chunk*);
+static int remapGlobal(Reader*, int);
+
+// Files stay mapped until exit, as loaded code is run in place.
+static Mapping* mappings = NULL;
+
+bool isBytecode(const char* path) {
+	char magic[MAGIC_LENGTH];
+	FILE* file = fopen(path, READ);
+	if (!file) {
+		return false;
+	}
+	size_t read = fread(magic, 1, MAGIC_LENGTH, file);
+	fclose(file);
+	return read == MAGIC_LENGTH && !memcmp(magic, BYTECODE_MAGIC, MAGIC_LENGTH);
+}
+
+bool writeBytecode(ObjFunction* function, const char* path) {
+	FILE* file = fopen(path, WRITE);
+	if (!file) {
+		return false;
+	}
+	fwrite(BYTECODE_MAGIC, 1, MAGIC_LENGTH, file);
+	writeU32(file, BYTECODE_VERSION);
+	writeU32(file, OP_COUNT);
+	bool written = writeGlobals(file);
+	writeFunction(file, function);
+	written = written && !ferror(file);
+	return !fclose(file) && written;
+}
+
+void writeU8(FILE* file, uint8_t byte) {
+	fputc(byte, file);
+}
+
+void writeU32(FILE* file, uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		writeU8(file, (value >> (i * 8)) & 0xff);
+	}
+}
+
+void writeU64(FILE* file, uint64_t value) {
+	writeU32(file, value & 0xffffffff);
+	writeU32(file, value >> 32);
+}
+
+void writeString(FILE* file, ObjString* string) {
+	writeU32(file, string->length);
+	fwrite(string->data, 1, string->length, file);
+}
+
+// Every slot is named, so the names are written in slot order.
+bool writeGlobals(FILE* file) {
+	int count = vm.globals.count;
+	ObjString** names = malloc(sizeof(ObjString*) * (count ? count : 1));
+	if (!names) {
+		return false;
+	}
+	for (int i = 0; i < vm.globalSlots.capacity; i++) {
+		Entry* entry = &vm.globalSlots.entries[i];
+		if (entry->key) {
+			names[(int)AS_NUMBER(entry->value)] = entry->key;
+		}
+	}
+	writeU32(file, count);
+	for (int i = 0; i < count; i++) {
+		writeString(file, names[i]);
+	}
+	free(names);
+	return true;
+}
+
+void writeFunction(FILE* file, ObjFunction* function) {
+	Chunk* chunk = &function->chunk;
+	writeU32(file, function->arity);
+	writeU32(file, function->upvalueCount);
+	writeU32(file, function->slotCount);
+	writeU8(file, function->name != NULL);
+	if (function->name) {
+		writeString(file, function->name);
+	}
+	writeCode(file, chunk);
+	writeU32(file, chunk->constants.count);
+	for (int i = 0; i < chunk->constants.count; i++) {
+		Value constant = chunk->constants.values[i];
+		if (IS_NUMBER(constant)) {
+			double number = AS_NUMBER(constant);
+			uint64_t bits;
+			memcpy(&bits, &number, sizeof(bits));
+			writeU8(file, CONSTANT_NUMBER);
+			writeU64(file, bits);
+		}
+		else if (IS_STRING(constant)) {
+			writeU8(file, CONSTANT_STRING);
+			writeString(file, AS_STRING(constant));
+		}
+		else {
+			writeU8(file, CONSTANT_FUNCTION);
+			writeFunction(file, AS_FUNCTION(constant));
+		}
+	}
+}
+
+// A chunk's code and line runs, and how many caches its code indexes.
+void writeCode(FILE* file, Chunk* chunk) {
+	writeU32(file, chunk->count);
+	fwrite(chunk->code, 1, chunk->count, file);
+	writeU32(file, chunk->lineCount);
+	for (int i = 0; i < chunk->lineCount; i++) {
+		writeU32(file, chunk->lines[i].offset);
+		writeU32(file, chunk->lines[i].line);
+	}
+	writeU32(file, chunk->cacheCount);
+}
+
+// Only what has to be an object is built on the heap. Bytecode is run
+// straight out of the mapping, which is private so that quickening does not
+// write through to the file. The file is trusted to have come from
+// writeBytecode(); only its framing is checked.
+ObjFunction* readBytecode(const char* path) {
+	size_t size;
+	uint8_t* data = mapFile(path, &size);
+	if (!data) {
+		fprintf(stderr, "Could not open file \"%s\".\n", path);
+		return NULL;
+	}
+	Reader reader;
+	reader.current = data + MAGIC_LENGTH;
+	reader.end = data + size;
+	reader.failed = false;
+	reader.globals = NULL;
+	reader.globalCount = 0;
+	reader.outOfGlobals = false;
+	if (size < MAGIC_LENGTH || memcmp(data, BYTECODE_MAGIC, MAGIC_LENGTH)) {
+		fprintf(stderr, "\"%s\" is not a valid bytecode file.\n", path);
+		return NULL;
+	}
+	if (readU32(&reader) != BYTECODE_VERSION || readU32(&reader) != OP_COUNT) {
+		fprintf(stderr, "\"%s\" was compiled by a different version of lox.\n", path);
+		return NULL;
+	}
+	readGlobals(&reader);
+	ObjFunction* function = reader.failed ? NULL : readFunction(&reader);
+	free(reader.globals);
+	if (reader.outOfGlobals) {
+		fprintf(stderr, "Too many global variables to load \"%s\".\n", path);
+		return NULL;
+	}
+	if (reader.failed || reader.current != reader.end) {
+		fprintf(stderr, "\"%s\" is not a valid bytecode file.\n", path);
+		return NULL;
+	}
+	return function;
+}
+
+void unmapBytecode() {
+	while (mappings) {
+		Mapping* mapping = mappings;
+		mappings = mapping->next;
+#ifdef MAP_BYTECODE
+		munmap(mapping->data, mapping->size);
+#else
+		free(mapping->data);
+#endif // MAP_BYTECODE
+		free(mapping);
+	}
+}
+
+// Falls back on reading the file into memory where mmap is unavailable.
+uint8_t* mapFile(const char* path, size_t* size) {
+	Mapping* mapping = malloc(sizeof(Mapping));
+	if (!mapping) {
+		return NULL;
+	}
+#ifdef MAP_BYTECODE
+	int fd = open(path, O_RDONLY);
+	struct stat status;
+	if (fd < 0 || fstat(fd, &status) || !status.st_size) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		free(mapping);
+		return NULL;
+	}
+	*size = (size_t)status.st_size;
+	uint8_t* data = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		free(mapping);
+		return NULL;
+	}
+#else
+	FILE* file = fopen(path, READ);
+	uint8_t* data = NULL;
+	if (file) {
+		fseek(file, 0L, SEEK_END);
+		*size = ftell(file);
+		rewind(file);
+		data = malloc(*size ? *size : 1);
+		if (data && fread(data, 1, *size, file) < *size) {
+			free(data);
+			data = NULL;
+		}
+		fclose(file);
+	}
+	if (!data) {
+		free(mapping);
+		return NULL;
+	}
+#endif // MAP_BYTECODE
+	mapping->data = data;
+	mapping->size = *size;
+	mapping->next = mappings;
+	mappings = mapping;
+	return data;
+}
+
+bool fits(Reader* reader, size_t size) {
+	if (reader->failed || (size_t)(reader->end - reader->current) < size) {
+		reader->failed = true;
+		return false;
+	}
+	return true;
+}
+
+uint8_t readU8(Reader* reader) {
+	return fits(reader, 1) ? *reader->current++ : 0;
+}
+
+uint32_t readU32(Reader* reader) {
+	if (!fits(reader, 4)) {
+		return 0;
+	}
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++) {
+		value |= (uint32_t)*reader->current++ << (i * 8);
+	}
+	return value;
+}
+
+uint64_t readU64(Reader* reader) {
+	uint64_t low = readU32(reader);
+	return low | (uint64_t)readU32(reader) << 32;
+}
+
+ObjString* readString(Reader* reader) {
+	uint32_t length = readU32(reader);
+	if (!fits(reader, length)) {
+		return NULL;
+	}
+	ObjString* string = copyString((const char*)reader->current, (int)length);
+	reader->current += length;
+	return string;
+}
+
+void readGlobals(Reader* reader) {
+	uint32_t count = readU32(reader);
+	if (!fits(reader, count * (size_t)4)) {
+		return;
+	}
+	reader->globals = malloc(sizeof(int) * (count ? count : 1));
+	if (!reader->globals) {
+		reader->failed = true;
+		return;
+	}
+	for (uint32_t i = 0; i < count && !reader->failed; i++) {
+		ObjString* name = readString(reader);
+		if (name) {
+			reader->globals[reader->globalCount++] = globalSlot(name);
+		}
+	}
+}
+
+ObjFunction* readFunction(Reader* reader) {
+	ObjFunction* function = newFunction();
+	push(OBJ_VAL(function));
+	Chunk* chunk = &function->chunk;
+	function->arity = (int)readU32(reader);
+	function->upvalueCount = (int)readU32(reader);
+	function->slotCount = (int)readU32(reader);
+	if (readU8(reader)) {
+		function->name = readString(reader);
+	}
+	readCode(reader, chunk);
+	uint32_t constantCount = readU32(reader);
+	for (uint32_t i = 0; i < constantCount && fits(reader, 1); i++) {
+		Value constant = NIL_VAL;
+		switch (readU8(reader)) {
+		case CONSTANT_NUMBER: {
+			uint64_t bits = readU64(reader);
+			double number;
+			memcpy(&number, &bits, sizeof(number));
+			constant = NUMBER_VAL(number);
+			break;
+		}
+		case CONSTANT_STRING: {
+			ObjString* string = readString(reader);
+			if (string) {
+				constant = OBJ_VAL(string);
+			}
+			break;
+		}
+		case CONSTANT_FUNCTION: {
+			ObjFunction* nested = readFunction(reader);
+			if (nested) {
+				constant = OBJ_VAL(nested);
+			}
+			break;
+		}
+		default:
+			reader->failed = true;
+			break;
+		}
+		addConstant(chunk, constant);
+	}
+	if (!reader->failed) {
+		remapGlobals(reader, chunk);
+	}
+	pop();
+	return reader->failed ? NULL : function;
+}
+
+void readCode(Reader* reader, Chunk* chunk) {
+	uint32_t count = readU32(reader);
+	if (fits(reader, count)) {
+		// Borrowed from the mapping; a capacity of zero keeps it from being freed.
+		chunk->code = reader->current;
+		chunk->count = (int)count;
+		reader->current += count;
+	}
+	uint32_t lineCount = readU32(reader);
+	if (fits(reader, lineCount * (size_t)8)) {
+		for (uint32_t i = 0; i < lineCount; i++) {
+			int offset = (int)readU32(reader);
+			writeLine(chunk, offset, (int)readU32(reader));
+		}
+	}
+	uint32_t cacheCount = readU32(reader);
+	if (cacheCount > count) {
+		reader->failed = true;
+	}
+	else if (cacheCount) {
+		chunk->caches = ALLOCATE(InlineCache, cacheCount);
+		chunk->cacheCapacity = (int)cacheCount;
+		for (uint32_t i = 0; i < cacheCount; i++) {
+			chunk->caches[i].count = 0;
+		}
+		chunk->cacheCount = (int)cacheCount;
+	}
+}
+
+// Slots are handed out as globals are first named, so the running VM may
+// have given a name a different slot than the compiling one did. Files are
+// written with only the long forms, for there is no widening an instruction
+// here; short ones are only kept for loading files that fit them.
+void remapGlobals(Reader* reader, Chunk* chunk) {
+	for (int offset = 0; offset < chunk->count && !reader->failed; offset += instructionLength(chunk, offset)) {
+		uint8_t* code = &chunk->code[offset];
+		switch (code[0]) {
+		case OP_GET_GLOBAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_SET_GLOBAL_POP: {
+			int slot = remapGlobal(reader, code[1]);
+			if (slot > UINT8_MAX) {
+				reader->outOfGlobals = true;
+				reader->failed = true;
+			}
+			else if (slot != code[1]) {
+				code[1] = (uint8_t)slot;
+			}
+			break;
+		}
+		case OP_GET_GLOBAL_LONG:
+		case OP_DEFINE_GLOBAL_LONG:
+		case OP_SET_GLOBAL_LONG: {
+			int old = code[1] << 8 | code[2];
+			int slot = remapGlobal(reader, old);
+			if (slot > UINT16_MAX) {
+				reader->outOfGlobals = true;
+				reader->failed = true;
+			}
+			else if (slot != old) {
+				code[1] = (slot >> 8) & 0xff;
+				code[2] = slot & 0xff;
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+}
+
+int remapGlobal(Reader* reader, int slot) {
+	if (slot >= reader->globalCount) {
+		reader->failed = true;
+		return 0;
+	}
+	return reader->globals[slot];
+}
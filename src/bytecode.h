@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+
+#define BYTECODE_MAGIC "LOXC"
+#define BYTECODE_VERSION 2
+
+typedef struct {
+	uint8_t* current;
+	uint8_t* end;
+	bool failed;
+	int* globals; // This VM's slot for each slot in the file.
+	int globalCount;
+	bool outOfGlobals; // Whether one of those is too wide for its operand.
+} Reader;
+
+bool isBytecode(const char*);
+bool writeBytecode(ObjFunction*, const char*);
+ObjFunction* readBytecode(const char*);
+void unmapBytecode();
+
+// Shared with heap snapshots.
+uint8_t* mapFile(const char*, size_t*);
+void writeU8(FILE*, uint8_t);
+void writeU32(FILE*, uint32_t);
+void writeU64(FILE*, uint64_t);
+void writeString(FILE*, ObjString*);
+void writeCode(FILE*, Chunk*);
+bool fits(Reader*, size_t);
+uint8_t readU8(Reader*);
+uint32_t readU32(Reader*);
+uint64_t readU64(Reader*);
+ObjString* readString(Reader*);
+void readCode(Reader*, Chunk*);
@@ -8,14 +8,23 @@ void initChunk(Chunk* chunk) {
 	chunk->count = 0;
 	chunk->capacity = 0;
 	chunk->code = NULL;
+	chunk->lineCount = 0;
+	chunk->lineCapacity = 0;
 	chunk->lines = NULL;
 	initValueArray(&chunk->constants);
+	chunk->cacheCount = 0;
+	chunk->cacheCapacity = 0;
+	chunk->caches = NULL;
 }
 
 void freeChunk(Chunk* chunk) {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
+	// Code loaded from a bytecode file belongs to its mapping.
+	if (chunk->capacity) {
+		FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+	}
+	FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
 	freeValueArray(&chunk->constants);
+	FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
 	initChunk(chunk);
 }
 
@@ -24,16 +33,228 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 		int oldCapacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(oldCapacity);
 		chunk->code = GROW_ARRAY(chunk->code, uint8_t, oldCapacity, chunk->capacity);
-		chunk->lines = GROW_ARRAY(chunk->lines, int, oldCapacity, chunk->capacity);
 	}
+	writeLine(chunk, chunk->count, line);
 	chunk->code[chunk->count] = byte;
-	chunk->lines[chunk->count] = line;
 	chunk->count++;
 }
 
+// Records that the code from offset on comes from line. Offsets must only
+// ever increase, and a run is only started when the line changes.
+void writeLine(Chunk* chunk, int offset, int line) {
+	if (chunk->lineCount && chunk->lines[chunk->lineCount - 1].line == line) {
+		return;
+	}
+	if (chunk->lineCapacity < chunk->lineCount + 1) {
+		int oldCapacity = chunk->lineCapacity;
+		chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->lines = GROW_ARRAY(chunk->lines, LineStart, oldCapacity, chunk->lineCapacity);
+	}
+	chunk->lines[chunk->lineCount].offset = offset;
+	chunk->lines[chunk->lineCount].line = line;
+	chunk->lineCount++;
+}
+
+// Drops the code from count on, along with the runs that only covered it.
+void truncateChunk(Chunk* chunk, int count) {
+	chunk->count = count;
+	while (chunk->lineCount && chunk->lines[chunk->lineCount - 1].offset >= count) {
+		chunk->lineCount--;
+	}
+}
+
+// Lines are only needed for errors and disassembly, so they are found by a
+// binary search over the runs rather than stored per byte.
+int getLine(Chunk* chunk, int offset) {
+	int low = 0;
+	int high = chunk->lineCount - 1;
+	while (low < high) {
+		int mid = low + (high - low + 1) / 2;
+		if (chunk->lines[mid].offset <= offset) {
+			low = mid;
+		}
+		else {
+			high = mid - 1;
+		}
+	}
+	return chunk->lines[low].line;
+}
+
 int addConstant(Chunk* chunk, Value value) {
 	push(value);
 	writeValueArray(&chunk->constants, value);
 	pop();
 	return chunk->constants.count - 1;
 }
+
+int addCache(Chunk* chunk) {
+	lockHeap();
+	if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+		int oldCapacity = chunk->cacheCapacity;
+		chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->caches = GROW_ARRAY(chunk->caches, InlineCache, oldCapacity, chunk->cacheCapacity);
+	}
+	chunk->caches[chunk->cacheCount].count = 0;
+	int cache = chunk->cacheCount++;
+	unlockHeap();
+	return cache;
+}
+
+int instructionLength(Chunk* chunk, int offset) {
+	switch (chunk->code[offset]) {
+	case OP_CONSTANT:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_GET_GLOBAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_CALL:
+	case OP_TAIL_CALL:
+	case OP_CLASS:
+	case OP_METHOD:
+	case OP_ARRAY:
+	case OP_ARRAY_APPEND:
+	case OP_POPN:
+	case OP_SET_LOCAL_POP:
+	case OP_SET_GLOBAL_POP:
+		return 2;
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_POP_JUMP_IF_FALSE:
+	case OP_EQUAL_JUMP:
+	case OP_NOT_EQUAL_JUMP:
+	case OP_GREATER_JUMP:
+	case OP_GREATER_EQUAL_JUMP:
+	case OP_LESS_JUMP:
+	case OP_LESS_EQUAL_JUMP:
+	case OP_LOOP:
+	case OP_GET_LOCAL_LOCAL:
+	case OP_GET_LOCAL_CONSTANT:
+	case OP_GET_LOCAL_LONG:
+	case OP_SET_LOCAL_LONG:
+	case OP_GET_GLOBAL_LONG:
+	case OP_DEFINE_GLOBAL_LONG:
+	case OP_SET_GLOBAL_LONG:
+	case OP_GET_UPVALUE_LONG:
+	case OP_SET_UPVALUE_LONG:
+		return 3;
+	case OP_CONSTANT_LONG:
+	case OP_CLASS_LONG:
+	case OP_METHOD_LONG:
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_GET_SUPER:
+		return 4;
+	case OP_INVOKE:
+	case OP_SUPER_INVOKE:
+	case OP_GET_LOCAL_PROPERTY:
+		return 5;
+	case OP_GET_PROPERTY_LONG:
+	case OP_SET_PROPERTY_LONG:
+	case OP_GET_SUPER_LONG:
+		return 6;
+	case OP_CLOSURE:
+	case OP_CLOSURE_LONG: {
+		uint8_t* code = &chunk->code[offset];
+		int constant = code[0] == OP_CLOSURE ? code[1] : code[1] << 16 | code[2] << 8 | code[3];
+		ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+		int length = code[0] == OP_CLOSURE ? 2 : 4;
+		for (int i = 0; i < function->upvalueCount; i++) {
+			length += code[length] & UPVALUE_LONG ? 3 : 2;
+		}
+		return length;
+	}
+	default:
+		return 1;
+	}
+}
+
+// How many values the instruction leaves on the stack, less how many it
+// takes. A call counts only its result, the callee's frame being its own.
+int stackEffect(Chunk* chunk, int offset) {
+	uint8_t* code = &chunk->code[offset];
+	switch (code[0]) {
+	case OP_CONSTANT:
+	case OP_CONSTANT_LONG:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_LOCAL_LONG:
+	case OP_GET_GLOBAL:
+	case OP_GET_GLOBAL_LONG:
+	case OP_GET_UPVALUE:
+	case OP_GET_UPVALUE_LONG:
+	case OP_GET_LOCAL_PROPERTY:
+	case OP_CLOSURE:
+	case OP_CLOSURE_LONG:
+	case OP_CLASS:
+	case OP_CLASS_LONG:
+		return 1;
+	case OP_GET_LOCAL_LOCAL:
+	case OP_GET_LOCAL_CONSTANT:
+		return 2;
+	case OP_POP:
+	case OP_DEFINE_GLOBAL:
+	case OP_DEFINE_GLOBAL_LONG:
+	case OP_SET_LOCAL_POP:
+	case OP_SET_GLOBAL_POP:
+	case OP_SET_PROPERTY:
+	case OP_SET_PROPERTY_LONG:
+	case OP_GET_INDEX:
+	case OP_GET_SUPER:
+	case OP_GET_SUPER_LONG:
+	case OP_EQUAL:
+	case OP_NOT_EQUAL:
+	case OP_GREATER:
+	case OP_GREATER_EQUAL:
+	case OP_LESS:
+	case OP_LESS_EQUAL:
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_EXPONENTIATE:
+	case OP_EQUAL_NUMBER:
+	case OP_NOT_EQUAL_NUMBER:
+	case OP_GREATER_NUMBER:
+	case OP_GREATER_EQUAL_NUMBER:
+	case OP_LESS_NUMBER:
+	case OP_LESS_EQUAL_NUMBER:
+	case OP_ADD_NUMBER:
+	case OP_SUBTRACT_NUMBER:
+	case OP_MULTIPLY_NUMBER:
+	case OP_DIVIDE_NUMBER:
+	case OP_PRINT:
+	case OP_POP_JUMP_IF_FALSE:
+	case OP_CLOSE_UPVALUE:
+	case OP_RETURN:
+	case OP_INHERIT:
+	case OP_METHOD:
+	case OP_METHOD_LONG:
+		return -1;
+	case OP_SET_INDEX:
+	case OP_EQUAL_JUMP:
+	case OP_NOT_EQUAL_JUMP:
+	case OP_GREATER_JUMP:
+	case OP_GREATER_EQUAL_JUMP:
+	case OP_LESS_JUMP:
+	case OP_LESS_EQUAL_JUMP:
+		return -2;
+	case OP_POPN:
+	case OP_CALL:
+	case OP_TAIL_CALL:
+	case OP_ARRAY_APPEND:
+		return -code[1];
+	case OP_ARRAY:
+		return 1 - code[1];
+	case OP_INVOKE:
+		return -code[2];
+	case OP_SUPER_INVOKE:
+		return -code[2] - 1;
+	default:
+		return 0;
+	}
+}
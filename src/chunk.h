@@ -3,14 +3,18 @@
 #include "common.h"
 #include "value.h"
 
+#define CACHE_WAYS 4
+// Flags heading each upvalue an OP_CLOSURE captures. A long index takes two
+// bytes rather than one.
+#define UPVALUE_LOCAL 0x1
+#define UPVALUE_LONG 0x2
+
 typedef enum {
 	OP_CONSTANT,
-	// TODO OP_CONSTANT_LONG
 	OP_NIL,
 	OP_TRUE,
 	OP_FALSE,
 	OP_POP,
-	// TODO OP_POP_N
 	OP_GET_LOCAL,
 	OP_SET_LOCAL,
 	OP_GET_GLOBAL,
@@ -24,8 +28,11 @@ typedef enum {
 	OP_SET_INDEX,
 	OP_GET_SUPER,
 	OP_EQUAL,
+	OP_NOT_EQUAL,
 	OP_GREATER,
+	OP_GREATER_EQUAL,
 	OP_LESS,
+	OP_LESS_EQUAL,
 	OP_ADD,
 	OP_SUBTRACT,
 	OP_MULTIPLY,
@@ -36,8 +43,17 @@ typedef enum {
 	OP_PRINT,
 	OP_JUMP,
 	OP_JUMP_IF_FALSE,
+	OP_POP_JUMP_IF_FALSE,
+	// Compare the top two values, pop them and jump if the comparison fails.
+	OP_EQUAL_JUMP,
+	OP_NOT_EQUAL_JUMP,
+	OP_GREATER_JUMP,
+	OP_GREATER_EQUAL_JUMP,
+	OP_LESS_JUMP,
+	OP_LESS_EQUAL_JUMP,
 	OP_LOOP,
 	OP_CALL,
+	OP_TAIL_CALL,
 	OP_INVOKE,
 	OP_SUPER_INVOKE,
 	OP_CLOSURE,
@@ -46,18 +62,91 @@ typedef enum {
 	OP_CLASS,
 	OP_INHERIT,
 	OP_METHOD,
-	OP_ARRAY
+	OP_ARRAY,
+	OP_ARRAY_APPEND,
+	// Long forms, emitted in place of the above only when an operand does not
+	// fit in a byte. Constant indices take three bytes and slots two.
+	OP_CONSTANT_LONG,
+	OP_GET_LOCAL_LONG,
+	OP_SET_LOCAL_LONG,
+	OP_GET_GLOBAL_LONG,
+	OP_DEFINE_GLOBAL_LONG,
+	OP_SET_GLOBAL_LONG,
+	OP_GET_UPVALUE_LONG,
+	OP_SET_UPVALUE_LONG,
+	OP_GET_PROPERTY_LONG,
+	OP_SET_PROPERTY_LONG,
+	OP_GET_SUPER_LONG,
+	OP_CLOSURE_LONG,
+	OP_CLASS_LONG,
+	OP_METHOD_LONG,
+	// Quickened forms, only ever written by the interpreter over the generic
+	// instruction once it has seen number operands there.
+	OP_EQUAL_NUMBER,
+	OP_NOT_EQUAL_NUMBER,
+	OP_GREATER_NUMBER,
+	OP_GREATER_EQUAL_NUMBER,
+	OP_LESS_NUMBER,
+	OP_LESS_EQUAL_NUMBER,
+	OP_ADD_NUMBER,
+	OP_SUBTRACT_NUMBER,
+	OP_MULTIPLY_NUMBER,
+	OP_DIVIDE_NUMBER,
+	// Superinstructions, fused from common sequences by the compiler's
+	// peephole pass. See DEBUG_PROFILE_OPCODES for finding candidates.
+	OP_POPN,
+	OP_GET_LOCAL_LOCAL,
+	OP_GET_LOCAL_CONSTANT,
+	OP_GET_LOCAL_PROPERTY,
+	OP_SET_LOCAL_POP,
+	OP_SET_GLOBAL_POP,
+	OP_COUNT
 } OpCode;
 
+// Keyed by the receiver's shape, or by the class for super calls. A
+// non-negative slot locates a field, and target is then the shape a store
+// moves the instance to, if any. Otherwise target is the method found.
+typedef struct {
+	Obj* key;
+	Obj* target;
+	int slot;
+} CacheEntry;
+
+// A site's memory of the properties it has resolved. Shapes are immutable
+// and a class's method table is only written while its declaration runs,
+// so entries never need invalidating.
+typedef struct {
+	int count;
+	CacheEntry entries[CACHE_WAYS];
+} InlineCache;
+
+// A run of bytecode compiled from one source line, lasting until the next
+// run's offset.
+typedef struct {
+	int offset;
+	int line;
+} LineStart;
+
 typedef struct {
 	int count;
 	int capacity;
 	uint8_t* code;
-	int* lines; // TODO use run-length encoding
+	int lineCount;
+	int lineCapacity;
+	LineStart* lines;
 	ValueArray constants;
+	int cacheCount;
+	int cacheCapacity;
+	InlineCache* caches;
 } Chunk;
 
 void initChunk(Chunk*);
 void freeChunk(Chunk*);
 void writeChunk(Chunk*, uint8_t, int);
+void writeLine(Chunk*, int, int);
+void truncateChunk(Chunk*, int);
+int getLine(Chunk*, int);
 int addConstant(Chunk*, Value);
+int addCache(Chunk*);
+int instructionLength(Chunk*, int);
+int stackEffect(Chunk*, int);
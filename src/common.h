@@ -9,8 +9,14 @@
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
 //#define DEBUG_DIAG_TOOLS
+//#define DEBUG_PROFILE_OPCODES
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 #define NAN_BOXING
 
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#undef COMPUTED_GOTO // Labels as values are a GNU extension.
+#endif
+
 // TODO use consistent NULL/0 check in control expressions
 // TODO hoist "private" globals to implementation files
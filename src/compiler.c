@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,13 +9,24 @@
 #include "debug.h"
 #include "memory.h"
 #include "object.h"
+#include "vm.h"
 
 #define PARAM_MAX 255
+#define CONSTANT_MAX 0xffffff
+#define INDEX_MAX_LOAD 0.75
 #define UNINITIALIZED -1
+#define CONTEXT_TYPE 0x3
+#define CONTEXT_CLASS 0x4
+#define CONTEXT_SUPERCLASS 0x8
+
+Compiler* current;
+ClassCompiler* currentClass;
+Parser parser;
 
 // TODO add support for switch statements and the ternary operator
 
 static void initComplier(Compiler*, FunctionType);
+static void freeCompiler(Compiler*);
 static void advance();
 static Token syntheticToken(const char* );
 static void consume(TokenType, const char*);
@@ -23,13 +35,17 @@ static void classDeclaration();
 static void method();
 static void funDeclaration();
 static void function(FunctionType);
+static void parameters();
+static void deferBody(const char*, int);
+static void capture(Token);
 static void varDeclaration();
-static uint8_t parseVariable(const char*);
+static uint16_t parseVariable(const char*);
 static void declareVariable();
 static bool identifiersEqual(Token*, Token*);
 static void addLocal(Token);
-static uint8_t identifierConstant(Token*);
-static void defineVariable(uint8_t);
+static int identifierConstant(Token*);
+static uint16_t identifierGlobal(Token*);
+static void defineVariable(uint16_t);
 static void markInitialized();
 static void statement();
 static void printStatement();
@@ -49,7 +65,7 @@ static void expression();
 static void parsePrecedence(Precedence);
 static ParseRule* getRule(TokenType);
 static void literal(bool);
-static uint8_t initializers();
+static void initializers();
 static void number(bool);
 static void string(bool);
 static void index_(bool);
@@ -67,16 +83,35 @@ static void variable(bool);
 static void namedVariable(Token, bool);
 static int resolveLocal(Compiler*, Token*);
 static int resolveUpvalue(Compiler*, Token*);
-static int addUpvalue(Compiler*, uint8_t, bool);
+static int resolveCapture(Compiler*, Token*);
+static int addUpvalue(Compiler*, uint16_t, bool);
 static void emitByte(uint8_t);
 static void emitBytes(uint8_t, uint8_t);
+static void emitConstantOperand(uint8_t, uint8_t, int);
+static void emitSlotOperand(uint8_t, uint8_t, int);
 static void emitConstant(Value);
-static uint8_t makeConstant(Value);
+static void emitValue(Value);
+static int foldableConstant();
+static Value constantValue(int);
+static bool foldBinary(TokenType, int);
+static void liveStatement(bool);
+static void discardCode(int);
+static void emitCache();
+static int makeConstant(Value);
+static int findConstant(Value);
+static void indexConstant(int);
+static int* probeIndex(int*, int, Value);
+static uint64_t constantBits(Value);
+static void emitCompare(uint8_t);
+static int emitConditionJump();
 static int emitJump(uint8_t);
 static void emitLoop(int);
 static void emitReturn();
 static Chunk* currentChunk();
 static ObjFunction* endCompiler();
+static void optimize(Chunk*);
+static int jumpTarget(Chunk*, int);
+static int stackDepth(Chunk*, int);
 static void error(const char*);
 static void errorAtCurrent(const char*);
 static void errorAt(Token*, const char*);
@@ -138,31 +173,80 @@ ObjFunction* compile(const char* source) {
 		declaration();
 	}
 	ObjFunction* function = endCompiler();
+	freeCompiler(&compiler);
 	return parser.hadError ? NULL : function;
 }
 
+// Compiles a body function() deferred, now that it has been called, into
+// the function the closure was made from.
+bool compileBody(ObjFunction* function) {
+	Compiler compiler;
+	ClassCompiler classCompiler;
+	classCompiler.enclosing = NULL;
+	classCompiler.hasSuperclass = function->context & CONTEXT_SUPERCLASS;
+	currentClass = function->context & CONTEXT_CLASS ? &classCompiler : NULL;
+	initScanner(function->source->data);
+	scanner.line = function->line;
+	parser.previous = syntheticToken(function->name->data);
+	initComplier(&compiler, function->context & CONTEXT_TYPE);
+	compiler.captures = &function->chunk.constants;
+	beginScope();
+	parser.hadError = false;
+	parser.panicMode = false;
+	advance();
+	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+	parameters();
+	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	block();
+	ObjFunction* compiled = endCompiler();
+	freeCompiler(&compiler);
+	currentClass = NULL;
+	if (parser.hadError) {
+		return false;
+	}
+	lockHeap();
+	freeChunk(&function->chunk);
+	function->chunk = compiled->chunk;
+	initChunk(&compiled->chunk);
+	unlockHeap();
+	function->slotCount = compiled->slotCount;
+	function->source = NULL;
+	rememberObject((Obj*)function);
+	return true;
+}
+
 void initComplier(Compiler* compiler, FunctionType type) {
 	compiler->enclosing = current;
 	compiler->function = NULL;
 	compiler->type = type;
+	compiler->locals = NULL;
 	compiler->localCount = 0;
+	compiler->localCapacity = 0;
+	compiler->upvalues = NULL;
+	compiler->upvalueCapacity = 0;
+	compiler->captures = NULL;
+	compiler->constantIndex = NULL;
+	compiler->indexCount = 0;
+	compiler->indexCapacity = 0;
 	compiler->scopeDepth = 0;
+	compiler->lastCompare = UNINITIALIZED;
+	compiler->lastTarget = UNINITIALIZED;
+	compiler->lastCall = UNINITIALIZED;
+	compiler->lastConstant = UNINITIALIZED;
 	compiler->function = newFunction();
 	current = compiler;
 	if (type != TYPE_SCRIPT) {
 		current->function->name = copyString(parser.previous.start, parser.previous.length);
 	}
-	Local* local = &current->locals[current->localCount++];
-	local->depth = 0;
-	local->isCaptured = false;
-	if (type != TYPE_FUNCTION) {
-		local->name.start = "this";
-		local->name.length = 4;
-	}
-	else {
-		local->name.start = "";
-		local->name.length = 0;
-	}
+	addLocal(syntheticToken(type != TYPE_FUNCTION ? "this" : ""));
+	current->locals[0].depth = 0;
+}
+
+void freeCompiler(Compiler* compiler) {
+	FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+	FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+	FREE_ARRAY(int, compiler->constantIndex, compiler->indexCapacity);
 }
 
 void advance() {
@@ -212,10 +296,10 @@ void declaration() {
 void classDeclaration() {
 	consume(TOKEN_IDENTIFIER, "Expect class name.");
 	Token className = parser.previous;
-	uint8_t nameConstant = identifierConstant(&className);
+	int nameConstant = identifierConstant(&className);
 	declareVariable();
-	emitBytes(OP_CLASS, nameConstant);
-	defineVariable(nameConstant);
+	emitConstantOperand(OP_CLASS, OP_CLASS_LONG, nameConstant);
+	defineVariable(current->scopeDepth ? 0 : identifierGlobal(&className));
 	ClassCompiler classCompiler;
 	classCompiler.enclosing = currentClass;
 	classCompiler.name = parser.previous;
@@ -249,17 +333,17 @@ void classDeclaration() {
 
 void method() {
 	consume(TOKEN_IDENTIFIER, "Expect method name.");
-	uint8_t constant = identifierConstant(&parser.previous);
+	int constant = identifierConstant(&parser.previous);
 	FunctionType type = TYPE_METHOD;
 	if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) { // TODO avoid magic constants
 		type = TYPE_INITIALIZER;
 	}
 	function(type);
-	emitBytes(OP_METHOD, constant);
+	emitConstantOperand(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 void funDeclaration() {
-	uint8_t global = parseVariable("Expect function name.");
+	uint16_t global = parseVariable("Expect function name.");
 	markInitialized();
 	function(TYPE_FUNCTION);
 	defineVariable(global);
@@ -270,6 +354,36 @@ void function(FunctionType type) {
 	initComplier(&compiler, type);
 	beginScope();
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+	const char* source = parser.previous.start;
+	int line = parser.previous.line;
+	parameters();
+	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	ObjFunction* function = compiler.function;
+	if (vm.lazyCompile) {
+		deferBody(source, line);
+		current = current->enclosing;
+	}
+	else {
+		block();
+		endCompiler();
+	}
+	emitConstantOperand(OP_CLOSURE, OP_CLOSURE_LONG, makeConstant(OBJ_VAL(function)));
+	for (int i = 0; i < function->upvalueCount; i++) {
+		uint8_t flags = compiler.upvalues[i].isLocal ? UPVALUE_LOCAL : 0;
+		uint16_t index = compiler.upvalues[i].index;
+		if (index > UINT8_MAX) {
+			emitBytes(flags | UPVALUE_LONG, (index >> 8) & 0xff);
+		}
+		else {
+			emitByte(flags);
+		}
+		emitByte(index & 0xff);
+	}
+	freeCompiler(&compiler);
+}
+
+void parameters() {
 	if (!check(TOKEN_RIGHT_PAREN)) {
 		do {
 			current->function->arity++;
@@ -277,24 +391,71 @@ void function(FunctionType type) {
 				// TODO concatenate PARAM_MAX to rest of msg before passing to errorAtCurrent
 				errorAtCurrent("Cannot have more than 255 parameters.");
 			}
-			uint8_t paramConstant = parseVariable("Expect parameter name.");
-			defineVariable(paramConstant);
+			defineVariable(parseVariable("Expect parameter name."));
 		} while (match(TOKEN_COMMA));
 	}
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-	block();
-	ObjFunction* function = endCompiler();
-	emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
-	for (int i = 0; i < function->upvalueCount; i++) {
-		uint8_t isLocal = compiler.upvalues[i].isLocal ? 1 : 0;
-		uint8_t index = compiler.upvalues[i].index;
-		emitBytes(isLocal, index);
+}
+
+// Skips to the end of the body, capturing every enclosing local it might
+// name so that its closure can be made before it is compiled. Names it
+// declares for itself may be captured needlessly, which costs only the
+// closing of an upvalue.
+void deferBody(const char* source, int line) {
+	int depth = 1;
+	TokenType previous = TOKEN_LEFT_BRACE;
+	while (depth && !check(TOKEN_EOF)) {
+		advance();
+		switch (parser.previous.type) {
+		case TOKEN_LEFT_BRACE:
+			depth++;
+			break;
+		case TOKEN_RIGHT_BRACE:
+			depth--;
+			break;
+		case TOKEN_IDENTIFIER:
+			if (previous != TOKEN_DOT) {
+				capture(parser.previous);
+			}
+			break;
+		case TOKEN_SUPER:
+			capture(syntheticToken("super"));
+			// Fall through, as 'super' also reads 'this'.
+		case TOKEN_THIS:
+			capture(syntheticToken("this"));
+			break;
+		default:
+			break;
+		}
+		previous = parser.previous.type;
+	}
+	if (depth) {
+		errorAtCurrent("Expect '}' after block.");
+		return;
+	}
+	ObjFunction* function = current->function;
+	const char* end = parser.previous.start + parser.previous.length;
+	function->source = copyString(source, (int)(end - source));
+	function->line = line;
+	function->context = (uint8_t)current->type;
+	if (currentClass) {
+		function->context |= CONTEXT_CLASS | (currentClass->hasSuperclass ? CONTEXT_SUPERCLASS : 0);
+	}
+}
+
+// Names of the upvalues are kept as the deferred function's constants, in
+// order, until its body is compiled.
+void capture(Token name) {
+	if (resolveLocal(current, &name) != UNINITIALIZED) {
+		return; // A parameter, which hides any enclosing local.
+	}
+	Chunk* chunk = currentChunk();
+	if (resolveUpvalue(current, &name) == chunk->constants.count) {
+		addConstant(chunk, OBJ_VAL(copyString(name.start, name.length)));
 	}
 }
 
 void varDeclaration() {
-	uint8_t global = parseVariable("Expect variable name.");
+	uint16_t global = parseVariable("Expect variable name.");
 	if (match(TOKEN_EQUAL)) {
 		expression();
 	}
@@ -305,13 +466,13 @@ void varDeclaration() {
 	defineVariable(global);
 }
 
-uint8_t parseVariable(const char* errorMessage) {
+uint16_t parseVariable(const char* errorMessage) {
 	consume(TOKEN_IDENTIFIER, errorMessage);
 	declareVariable();
 	if (current->scopeDepth) {
 		return 0;
 	}
-	return identifierConstant(&parser.previous);
+	return identifierGlobal(&parser.previous);
 }
 
 void declareVariable() {
@@ -339,35 +500,43 @@ bool identifiersEqual(Token* a, Token* b) {
 }
 
 void addLocal(Token name) {
-	if (current->localCount == UINT8_MAX) {
+	if (current->localCount == UINT16_COUNT) {
 		error("Too many local variables in function.");
 		return;
 	}
+	if (current->localCapacity < current->localCount + 1) {
+		int oldCapacity = current->localCapacity;
+		current->localCapacity = GROW_CAPACITY(oldCapacity);
+		current->locals = GROW_ARRAY(current->locals, Local, oldCapacity, current->localCapacity);
+	}
 	Local* local = &current->locals[current->localCount++];
 	local->name = name;
 	local->depth = UNINITIALIZED;
 	local->isCaptured = false;
 }
 
-uint8_t identifierConstant(Token* name) {
-	ValueArray constants = currentChunk()->constants;
-	for (int i = 0; i < constants.count; i++) {
-		if (IS_STRING(constants.values[i])) {
-			ObjString* string = AS_STRING(constants.values[i]);
-			if (name->length == string->length && !memcmp(name->start, string->data, name->length)) {
-				return i;
-			}
-		}
-	}
+int identifierConstant(Token* name) {
 	return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
-void defineVariable(uint8_t global) {
+// Global operands are at most two bytes wide, so no slot is handed out past
+// them.
+uint16_t identifierGlobal(Token* name) {
+	ObjString* string = copyString(name->start, name->length);
+	Value slot;
+	if (!tableGet(&vm.globalSlots, string, &slot) && vm.globals.count == UINT16_COUNT) {
+		error("Too many global variables.");
+		return 0;
+	}
+	return (uint16_t)globalSlot(string);
+}
+
+void defineVariable(uint16_t global) {
 	if (current->scopeDepth) { // TODO get name of local to runtime
 		markInitialized();
 		return;
 	}
-	emitBytes(OP_DEFINE_GLOBAL, global);
+	emitSlotOperand(vm.wideGlobals ? OP_DEFINE_GLOBAL_LONG : OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 void markInitialized() {
@@ -422,6 +591,11 @@ void returnStatement() {
 		}
 		expression();
 		consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+		if (current->lastCall == currentChunk()->count - 2) {
+			// The OP_RETURN still follows, for jumps that land after the call
+			// and for callees that are not closures.
+			currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+		}
 		emitByte(OP_RETURN);
 	}
 }
@@ -431,16 +605,27 @@ void ifStatement() {
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
 	expression();
 	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-	thenJump = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
+	int condition = foldableConstant();
+	if (condition != UNINITIALIZED) {
+		bool truthy = !isFalsey(constantValue(condition));
+		discardCode(condition);
+		liveStatement(truthy);
+		if (match(TOKEN_ELSE)) {
+			liveStatement(!truthy);
+		}
+		return;
+	}
+	thenJump = emitConditionJump();
 	statement();
-	elseJump = emitJump(OP_JUMP);
-	patchJump(thenJump);
-	emitByte(OP_POP);
 	if (match(TOKEN_ELSE)) {
+		elseJump = emitJump(OP_JUMP);
+		patchJump(thenJump);
 		statement();
 		patchJump(elseJump);
 	}
+	else {
+		patchJump(thenJump);
+	}
 }
 
 void whileStatement() {
@@ -448,12 +633,20 @@ void whileStatement() {
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
 	expression();
 	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condtion.");
-	int exitJump = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
+	int condition = foldableConstant();
+	if (condition != UNINITIALIZED) {
+		bool truthy = !isFalsey(constantValue(condition));
+		discardCode(condition);
+		liveStatement(truthy);
+		if (truthy) {
+			emitLoop(loopStart);
+		}
+		return;
+	}
+	int exitJump = emitConditionJump();
 	statement();
 	emitLoop(loopStart);
 	patchJump(exitJump);
-	emitByte(OP_POP);
 }
 
 void forStatement() {
@@ -472,8 +665,7 @@ void forStatement() {
 	if (!match(TOKEN_SEMICOLON)) {
 		expression();
 		consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-		exitJump = emitJump(OP_JUMP_IF_FALSE);
-		emitByte(OP_POP);
+		exitJump = emitConditionJump();
 	}
 	if (!match(TOKEN_RIGHT_PAREN)) {
 		int bodyJump = emitJump(OP_JUMP);
@@ -489,7 +681,6 @@ void forStatement() {
 	emitLoop(loopStart);
 	if (exitJump != UNINITIALIZED) {
 		patchJump(exitJump);
-		emitByte(OP_POP);
 	}
 	endScope();
 }
@@ -501,6 +692,7 @@ void patchJump(int offset) {
 	}
 	currentChunk()->code[offset] = (jump >> 8) & 0xff;
 	currentChunk()->code[offset + 1] = jump & 0xff;
+	current->lastTarget = currentChunk()->count;
 }
 
 void block() {
@@ -596,39 +788,42 @@ ParseRule* getRule(TokenType type) {
 
 void literal(bool canAssign) {
 	switch (parser.previous.type) {
-	case TOKEN_LEFT_BRACE: {
-		uint8_t elements = initializers();
-		emitBytes(OP_ARRAY, elements);
+	case TOKEN_LEFT_BRACE:
+		initializers();
 		break;
-	}
 	case TOKEN_FALSE:
-		emitByte(OP_FALSE);
+		emitValue(BOOL_VAL(false));
 		break;
 	case TOKEN_NIL:
-		emitByte(OP_NIL);
+		emitValue(NIL_VAL);
 		break;
 	case TOKEN_TRUE:
-		emitByte(OP_TRUE);
+		emitValue(BOOL_VAL(true));
 		break;
 	default:
 		return; // TODO need internal error logic
 	}
 }
 
-uint8_t initializers() {
-	uint8_t count = 0;
+// Elements are gathered on the stack and moved into the array a batch at a
+// time, so a long literal never holds more than a batch of temporaries.
+void initializers() {
+	bool created = false;
+	int batch = 0;
 	if (!check(TOKEN_RIGHT_BRACE)) {
 		do {
 			expression();
-			if (count == PARAM_MAX) {
-				// TODO concatenate PARAM_MAX to rest of msg before passing to error
-				error("Cannot initialize an array with more than 255 elements.");
+			if (++batch == UINT8_MAX) {
+				emitBytes(created ? OP_ARRAY_APPEND : OP_ARRAY, (uint8_t)batch);
+				created = true;
+				batch = 0;
 			}
-			count++;
 		} while (match(TOKEN_COMMA));
 	}
 	consume(TOKEN_RIGHT_BRACE, "Expect '}' after array initializers.");
-	return count;
+	if (!created || batch) {
+		emitBytes(created ? OP_ARRAY_APPEND : OP_ARRAY, (uint8_t)batch);
+	}
 }
 
 void number(bool canAssign) {
@@ -655,6 +850,7 @@ void index_(bool canAssign) {
 void call(bool canAssign) {
 	uint8_t argCount = argumentList();
 	emitBytes(OP_CALL, argCount);
+	current->lastCall = currentChunk()->count - 2;
 }
 
 uint8_t argumentList() {
@@ -675,24 +871,40 @@ uint8_t argumentList() {
 
 void dot(bool canAssign) {
 	consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-	uint8_t name = identifierConstant(&parser.previous);
+	int name = identifierConstant(&parser.previous);
 	if (canAssign && match(TOKEN_EQUAL)) {
 		expression();
-		emitBytes(OP_SET_PROPERTY, name);
+		emitConstantOperand(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
 	}
-	else if (match(TOKEN_LEFT_PAREN)) {
+	else if (name <= UINT8_MAX && match(TOKEN_LEFT_PAREN)) {
 		uint8_t argCount = argumentList();
 		emitBytes(OP_INVOKE, name);
 		emitByte(argCount);
 	}
 	else {
-		emitBytes(OP_GET_PROPERTY, name);
+		// A method named by a long operand is fetched here and called by call().
+		emitConstantOperand(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
 	}
+	emitCache();
 }
 
 void unary(bool canAssign) {
 	TokenType operatorType = parser.previous.type;
 	parsePrecedence(PREC_UNARY);
+	int operand = foldableConstant();
+	if (operand != UNINITIALIZED) {
+		Value value = constantValue(operand);
+		if (operatorType == TOKEN_BANG) {
+			discardCode(operand);
+			emitValue(BOOL_VAL(isFalsey(value)));
+			return;
+		}
+		if (operatorType == TOKEN_MINUS && IS_NUMBER(value)) {
+			discardCode(operand);
+			emitValue(NUMBER_VAL(-AS_NUMBER(value)));
+			return;
+		}
+	}
 	switch (operatorType) {
 	case TOKEN_BANG:
 		emitByte(OP_NOT);
@@ -707,26 +919,30 @@ void unary(bool canAssign) {
 
 void binary(bool canAssign) {
 	TokenType operatorType = parser.previous.type;
+	int lhs = foldableConstant();
 	ParseRule* rule = getRule(operatorType);
 	parsePrecedence((Precedence)(rule->precedence + 1));
+	if (lhs != UNINITIALIZED && foldBinary(operatorType, lhs)) {
+		return;
+	}
 	switch (operatorType) {
 	case TOKEN_BANG_EQUAL:
-		emitBytes(OP_EQUAL, OP_NOT);
+		emitCompare(OP_NOT_EQUAL);
 		break;
 	case TOKEN_EQUAL_EQUAL:
-		emitByte(OP_EQUAL);
+		emitCompare(OP_EQUAL);
 		break;
 	case TOKEN_GREATER:
-		emitByte(OP_GREATER);
+		emitCompare(OP_GREATER);
 		break;
 	case TOKEN_GREATER_EQUAL:
-		emitBytes(OP_LESS, OP_NOT);
+		emitCompare(OP_GREATER_EQUAL);
 		break;
 	case TOKEN_LESS:
-		emitByte(OP_LESS);
+		emitCompare(OP_LESS);
 		break;
 	case TOKEN_LESS_EQUAL:
-		emitBytes(OP_GREATER, OP_NOT);
+		emitCompare(OP_LESS_EQUAL);
 		break;
 	case TOKEN_PLUS:
 		emitByte(OP_ADD);
@@ -778,9 +994,9 @@ void super_(bool canAssign) {
 	}
 	consume(TOKEN_DOT, "Expect '.' after 'super'");
 	consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-	uint8_t name = identifierConstant(&parser.previous);
+	int name = identifierConstant(&parser.previous);
 	namedVariable(syntheticToken("this"), false);
-	if (match(TOKEN_LEFT_PAREN)) {
+	if (name <= UINT8_MAX && match(TOKEN_LEFT_PAREN)) {
 		uint8_t argCount = argumentList();
 		namedVariable(syntheticToken("super"), false);
 		emitBytes(OP_SUPER_INVOKE, name);
@@ -788,8 +1004,9 @@ void super_(bool canAssign) {
 	}
 	else {
 		namedVariable(syntheticToken("super"), false);
-		emitBytes(OP_GET_SUPER, name);
+		emitConstantOperand(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
 	}
+	emitCache();
 }
 
 void this_(bool canAssign) {
@@ -805,27 +1022,33 @@ void variable(bool canAssign) {
 }
 
 void namedVariable(Token name, bool canAssign) {
-	uint8_t getOp, setOp;
+	uint8_t getOp, setOp, getLongOp, setLongOp;
 	int arg;
 	if ((arg = resolveLocal(current, &name)) != UNINITIALIZED) {
 		getOp = OP_GET_LOCAL;
 		setOp = OP_SET_LOCAL;
+		getLongOp = OP_GET_LOCAL_LONG;
+		setLongOp = OP_SET_LOCAL_LONG;
 	}
 	else if ((arg = resolveUpvalue(current, &name)) != UNINITIALIZED) {
 		getOp = OP_GET_UPVALUE;
 		setOp = OP_SET_UPVALUE;
+		getLongOp = OP_GET_UPVALUE_LONG;
+		setLongOp = OP_SET_UPVALUE_LONG;
 	}
 	else {
-		arg = identifierConstant(&name);
-		getOp = OP_GET_GLOBAL;
-		setOp = OP_SET_GLOBAL;
+		arg = identifierGlobal(&name);
+		getLongOp = OP_GET_GLOBAL_LONG;
+		setLongOp = OP_SET_GLOBAL_LONG;
+		getOp = vm.wideGlobals ? getLongOp : OP_GET_GLOBAL;
+		setOp = vm.wideGlobals ? setLongOp : OP_SET_GLOBAL;
 	}
 	if (canAssign && match(TOKEN_EQUAL)) {
 		expression();
-		emitBytes(setOp, (uint8_t)arg);
+		emitSlotOperand(setOp, setLongOp, arg);
 	}
 	else {
-		emitBytes(getOp, (uint8_t)arg);
+		emitSlotOperand(getOp, getLongOp, arg);
 	}
 }
 
@@ -845,21 +1068,33 @@ int resolveLocal(Compiler* compiler, Token* name) {
 int resolveUpvalue(Compiler* compiler, Token* name) {
 	int local, upvalue;
 	if (!compiler->enclosing) {
-		return UNINITIALIZED;
+		return compiler->captures ? resolveCapture(compiler, name) : UNINITIALIZED;
 	}
 	local = resolveLocal(compiler->enclosing, name);
 	if (local != UNINITIALIZED) {
 		compiler->enclosing->locals[local].isCaptured = true;
-		return addUpvalue(compiler, (uint8_t)local, true);
+		return addUpvalue(compiler, (uint16_t)local, true);
 	}
 	upvalue = resolveUpvalue(compiler->enclosing, name);
 	if (upvalue != UNINITIALIZED) {
-		return addUpvalue(compiler, (uint8_t)local, false);
+		return addUpvalue(compiler, (uint16_t)upvalue, false);
 	}
 	return UNINITIALIZED;
 }
 
-int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+// A deferred body resolves the names it was scanned for to the upvalues
+// its closure was made with.
+int resolveCapture(Compiler* compiler, Token* name) {
+	for (int i = 0; i < compiler->captures->count; i++) {
+		ObjString* capture = AS_STRING(compiler->captures->values[i]);
+		if (capture->length == name->length && !memcmp(capture->data, name->start, name->length)) {
+			return i;
+		}
+	}
+	return UNINITIALIZED;
+}
+
+int addUpvalue(Compiler* compiler, uint16_t index, bool isLocal) {
 	int upvalueCount = compiler->function->upvalueCount;
 	for (int i = 0; i < upvalueCount; i++) {
 		Upvalue* upvalue = &compiler->upvalues[i];
@@ -867,10 +1102,15 @@ int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
 			return i;
 		}
 	}
-	if (upvalueCount == UINT8_COUNT) {
+	if (upvalueCount == UINT16_COUNT) {
 		error("Too many closure variables in function.");
 		return 0;
 	}
+	if (compiler->upvalueCapacity < upvalueCount + 1) {
+		int oldCapacity = compiler->upvalueCapacity;
+		compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+		compiler->upvalues = GROW_ARRAY(compiler->upvalues, Upvalue, oldCapacity, compiler->upvalueCapacity);
+	}
 	compiler->upvalues[upvalueCount].isLocal = isLocal;
 	compiler->upvalues[upvalueCount].index = index;
 	return compiler->function->upvalueCount++;
@@ -885,17 +1125,302 @@ void emitBytes(uint8_t one, uint8_t two) {
 	emitByte(two);
 }
 
+// Emits op with a one-byte constant index, or longOp with a three-byte one
+// if the index does not fit.
+void emitConstantOperand(uint8_t op, uint8_t longOp, int constant) {
+	if (constant <= UINT8_MAX) {
+		emitBytes(op, (uint8_t)constant);
+		return;
+	}
+	emitBytes(longOp, (constant >> 16) & 0xff);
+	emitBytes((constant >> 8) & 0xff, constant & 0xff);
+}
+
+// Emits op with a one-byte slot, or longOp with a two-byte one if the slot
+// does not fit or op is longOp itself.
+void emitSlotOperand(uint8_t op, uint8_t longOp, int slot) {
+	if (slot <= UINT8_MAX && op != longOp) {
+		emitBytes(op, (uint8_t)slot);
+		return;
+	}
+	emitByte(longOp);
+	emitBytes((slot >> 8) & 0xff, slot & 0xff);
+}
+
 void emitConstant(Value value) {
-	emitBytes(OP_CONSTANT, makeConstant(value));
+	int constant = makeConstant(value);
+	current->lastConstant = currentChunk()->count;
+	emitConstantOperand(OP_CONSTANT, OP_CONSTANT_LONG, constant);
+}
+
+void emitValue(Value value) {
+	if (IS_NIL(value)) {
+		emitByte(OP_NIL);
+	}
+	else if (IS_BOOL(value)) {
+		emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+	}
+	else {
+		emitConstant(value);
+		return;
+	}
+	current->lastConstant = currentChunk()->count - 1;
+}
+
+// Returns the offset of the literal the code so far ends with, or
+// UNINITIALIZED if it does not end with one or a jump lands after it.
+int foldableConstant() {
+	int offset = current->lastConstant;
+	if (offset == UNINITIALIZED || current->lastTarget > offset
+			|| offset + instructionLength(currentChunk(), offset) != currentChunk()->count) {
+		return UNINITIALIZED;
+	}
+	return offset;
+}
+
+Value constantValue(int offset) {
+	Chunk* chunk = currentChunk();
+	switch (chunk->code[offset]) {
+	case OP_NIL:
+		return NIL_VAL;
+	case OP_TRUE:
+		return BOOL_VAL(true);
+	case OP_FALSE:
+		return BOOL_VAL(false);
+	case OP_CONSTANT_LONG: {
+		uint8_t* code = &chunk->code[offset];
+		return chunk->constants.values[code[1] << 16 | code[2] << 8 | code[3]];
+	}
+	default:
+		return chunk->constants.values[chunk->code[offset + 1]];
+	}
 }
 
-uint8_t makeConstant(Value value) {
+// Replaces a binary operation on two literals with its result, following the
+// same rules as the interpreter. Operations that would fail at runtime are
+// left for the interpreter to report.
+bool foldBinary(TokenType operatorType, int lhs) {
+	int rhs = foldableConstant();
+	if (rhs == UNINITIALIZED || rhs != lhs + instructionLength(currentChunk(), lhs)) {
+		return false;
+	}
+	Value a = constantValue(lhs);
+	Value b = constantValue(rhs);
+	Value result;
+	if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+		result = BOOL_VAL(valuesEqual(a, b) == (operatorType == TOKEN_EQUAL_EQUAL));
+	}
+	else if (operatorType == TOKEN_PLUS && (IS_STRING(a) || IS_STRING(b))) {
+		ObjString* left = valueToString(a);
+		push(OBJ_VAL(left));
+		ObjString* right = valueToString(b);
+		push(OBJ_VAL(right));
+		ObjString* string = newString(left->length + right->length);
+		memcpy(string->data, left->data, left->length);
+		memcpy(string->data + left->length, right->data, right->length);
+		result = OBJ_VAL(internString(string));
+		pop();
+		pop();
+	}
+	else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		double x = AS_NUMBER(a), y = AS_NUMBER(b);
+		switch (operatorType) {
+		case TOKEN_GREATER:
+			result = BOOL_VAL(x > y);
+			break;
+		case TOKEN_GREATER_EQUAL:
+			result = BOOL_VAL(x >= y);
+			break;
+		case TOKEN_LESS:
+			result = BOOL_VAL(x < y);
+			break;
+		case TOKEN_LESS_EQUAL:
+			result = BOOL_VAL(x <= y);
+			break;
+		case TOKEN_PLUS:
+			result = NUMBER_VAL(x + y);
+			break;
+		case TOKEN_MINUS:
+			result = NUMBER_VAL(x - y);
+			break;
+		case TOKEN_STAR:
+			result = NUMBER_VAL(x * y);
+			break;
+		case TOKEN_STAR_STAR:
+			result = NUMBER_VAL(pow(x, y));
+			break;
+		case TOKEN_SLASH:
+			result = NUMBER_VAL(x / y);
+			break;
+		default:
+			return false;
+		}
+	}
+	else {
+		return false;
+	}
+	push(result);
+	discardCode(lhs);
+	emitValue(result);
+	pop();
+	return true;
+}
+
+// Compiles a statement, keeping its code only if it is reachable.
+void liveStatement(bool live) {
+	int start = currentChunk()->count;
+	statement();
+	if (!live) {
+		discardCode(start);
+	}
+}
+
+// Drops the code emitted from offset on, along with what the compiler
+// remembers about it.
+void discardCode(int offset) {
+	truncateChunk(currentChunk(), offset);
+	if (current->lastCompare >= offset) {
+		current->lastCompare = UNINITIALIZED;
+	}
+	if (current->lastCall >= offset) {
+		current->lastCall = UNINITIALIZED;
+	}
+	if (current->lastConstant >= offset) {
+		current->lastConstant = UNINITIALIZED;
+	}
+	if (current->lastTarget > offset) {
+		current->lastTarget = offset;
+	}
+}
+
+void emitCache() {
+	int cache = addCache(currentChunk());
+	if (cache > UINT16_MAX) {
+		error("Too many property accesses in one chunk.");
+	}
+	emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+// Strings and numbers already in the chunk are reused rather than added
+// again, which keeps more indices small enough for the short forms.
+int makeConstant(Value value) {
+	bool shareable = IS_STRING(value) || IS_NUMBER(value);
+	if (shareable) {
+		int constant = findConstant(value);
+		if (constant != UNINITIALIZED) {
+			return constant;
+		}
+	}
 	int constant = addConstant(currentChunk(), value);
-	if (constant > UINT8_MAX) {
-		error("Too many constatns in one chunk.");
+	if (constant > CONSTANT_MAX) {
+		error("Too many constants in one chunk.");
 		return 0;
 	}
-	return (uint8_t)constant;
+	if (shareable) {
+		indexConstant(constant);
+	}
+	return constant;
+}
+
+int findConstant(Value value) {
+	if (!current->indexCount) {
+		return UNINITIALIZED;
+	}
+	return *probeIndex(current->constantIndex, current->indexCapacity, value);
+}
+
+// Done once the constant is in the chunk, where it is safe from a collection
+// triggered by growing the index.
+void indexConstant(int constant) {
+	Value* constants = currentChunk()->constants.values;
+	if (current->indexCapacity * INDEX_MAX_LOAD < current->indexCount + 1) {
+		int capacity = GROW_CAPACITY(current->indexCapacity);
+		int* index = ALLOCATE(int, capacity);
+		for (int i = 0; i < capacity; i++) {
+			index[i] = UNINITIALIZED;
+		}
+		for (int i = 0; i < current->indexCapacity; i++) {
+			int old = current->constantIndex[i];
+			if (old != UNINITIALIZED) {
+				*probeIndex(index, capacity, constants[old]) = old;
+			}
+		}
+		FREE_ARRAY(int, current->constantIndex, current->indexCapacity);
+		current->constantIndex = index;
+		current->indexCapacity = capacity;
+	}
+	*probeIndex(current->constantIndex, current->indexCapacity, constants[constant]) = constant;
+	current->indexCount++;
+}
+
+// Returns the entry holding the constant with the same bits as value, or the
+// empty entry where it belongs. Interned strings match by pointer.
+int* probeIndex(int* index, int capacity, Value value) {
+	Value* constants = currentChunk()->constants.values;
+	uint64_t bits = constantBits(value);
+	uint64_t hash = bits * 0x9e3779b97f4a7c15;
+	for (int i = (int)(hash >> 32) & (capacity - 1);; i = (i + 1) & (capacity - 1)) {
+		if (index[i] == UNINITIALIZED) {
+			return &index[i];
+		}
+		Value constant = constants[index[i]];
+		if (IS_NUMBER(constant) == IS_NUMBER(value) && constantBits(constant) == bits) {
+			return &index[i];
+		}
+	}
+}
+
+uint64_t constantBits(Value value) {
+#ifdef NAN_BOXING
+	return value;
+#else
+	if (IS_NUMBER(value)) {
+		uint64_t bits;
+		double number = AS_NUMBER(value);
+		memcpy(&bits, &number, sizeof(bits));
+		return bits;
+	}
+	return (uint64_t)(uintptr_t)AS_OBJ(value);
+#endif // NAN_BOXING
+}
+
+void emitCompare(uint8_t instruction) {
+	emitByte(instruction);
+	current->lastCompare = currentChunk()->count - 1;
+}
+
+// Emits the jump taken when a just-compiled condition is false, popping the
+// condition either way. A trailing comparison is fused into the jump unless
+// some other jump lands right after it.
+int emitConditionJump() {
+	Chunk* chunk = currentChunk();
+	if (current->lastCompare != chunk->count - 1 || current->lastTarget == chunk->count) {
+		return emitJump(OP_POP_JUMP_IF_FALSE);
+	}
+	uint8_t instruction;
+	uint8_t compare = chunk->code[chunk->count - 1];
+	discardCode(chunk->count - 1);
+	switch (compare) {
+	case OP_EQUAL:
+		instruction = OP_EQUAL_JUMP;
+		break;
+	case OP_NOT_EQUAL:
+		instruction = OP_NOT_EQUAL_JUMP;
+		break;
+	case OP_GREATER:
+		instruction = OP_GREATER_JUMP;
+		break;
+	case OP_GREATER_EQUAL:
+		instruction = OP_GREATER_EQUAL_JUMP;
+		break;
+	case OP_LESS:
+		instruction = OP_LESS_JUMP;
+		break;
+	default:
+		instruction = OP_LESS_EQUAL_JUMP;
+		break;
+	}
+	return emitJump(instruction);
 }
 
 int emitJump(uint8_t instruction) {
@@ -931,6 +1456,10 @@ Chunk* currentChunk() {
 ObjFunction* endCompiler() {
 	emitReturn();
 	ObjFunction* function = current->function;
+	if (!parser.hadError) {
+		optimize(currentChunk());
+		function->slotCount = stackDepth(currentChunk(), function->arity + 1);
+	}
 #ifdef DEBUG_PRINT_CODE
 	if (!parser.hadError) {
 		printf("Compilation summary for: ");
@@ -975,3 +1504,160 @@ void markCompilerRoots() {
 		compiler = compiler->enclosing;
 	}
 }
+
+// Fuses common instruction sequences into superinstructions. Code only ever
+// shrinks, so the chunk is rewritten in place. A sequence is left alone if a
+// jump lands inside it, and jump offsets are remapped once everything has
+// moved.
+void optimize(Chunk* chunk) {
+	int count = chunk->count;
+	uint8_t* code = chunk->code;
+	LineStart* lines = chunk->lines;
+	int lineCount = chunk->lineCount;
+	int lineCapacity = chunk->lineCapacity;
+	int run = 0;
+	bool* landing = ALLOCATE(bool, count + 1);
+	int* newOffsets = ALLOCATE(int, count + 1);
+	int* oldTargets = ALLOCATE(int, count);
+	for (int i = 0; i < count; i++) {
+		landing[i] = false;
+		oldTargets[i] = UNINITIALIZED;
+	}
+	landing[count] = false;
+	for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+		int target = jumpTarget(chunk, offset);
+		if (target != UNINITIALIZED) {
+			landing[target] = true;
+		}
+	}
+	int to = 0;
+	chunk->lines = NULL;
+	chunk->lineCount = 0;
+	chunk->lineCapacity = 0;
+	for (int from = 0; from < count;) {
+		int length = instructionLength(chunk, from);
+		int next = from + length;
+		uint8_t op = code[from];
+		uint8_t nextOp = next < count && !landing[next] ? code[next] : OP_COUNT;
+		uint8_t fused[5];
+		int fusedLength = 0;
+		newOffsets[from] = to;
+		oldTargets[to] = jumpTarget(chunk, from);
+		while (run + 1 < lineCount && lines[run + 1].offset <= from) {
+			run++;
+		}
+		writeLine(chunk, to, lines[run].line);
+		if (op == OP_GET_LOCAL && nextOp == OP_GET_LOCAL) {
+			fused[fusedLength++] = OP_GET_LOCAL_LOCAL;
+			fused[fusedLength++] = code[from + 1];
+			fused[fusedLength++] = code[next + 1];
+		}
+		else if (op == OP_GET_LOCAL && nextOp == OP_CONSTANT) {
+			fused[fusedLength++] = OP_GET_LOCAL_CONSTANT;
+			fused[fusedLength++] = code[from + 1];
+			fused[fusedLength++] = code[next + 1];
+		}
+		else if (op == OP_GET_LOCAL && nextOp == OP_GET_PROPERTY) {
+			fused[fusedLength++] = OP_GET_LOCAL_PROPERTY;
+			fused[fusedLength++] = code[from + 1];
+			for (int i = 1; i < 4; i++) {
+				fused[fusedLength++] = code[next + i];
+			}
+		}
+		else if (op == OP_SET_LOCAL && nextOp == OP_POP) {
+			fused[fusedLength++] = OP_SET_LOCAL_POP;
+			fused[fusedLength++] = code[from + 1];
+		}
+		else if (op == OP_SET_GLOBAL && nextOp == OP_POP) {
+			fused[fusedLength++] = OP_SET_GLOBAL_POP;
+			fused[fusedLength++] = code[from + 1];
+		}
+		else if (op == OP_POP && nextOp == OP_POP) {
+			while (next < count && code[next] == OP_POP && !landing[next] && next - from < UINT8_MAX) {
+				next++;
+			}
+			fused[fusedLength++] = OP_POPN;
+			fused[fusedLength++] = (uint8_t)(next - from);
+		}
+		if (fusedLength) {
+			if (op != OP_POP) {
+				next += instructionLength(chunk, next);
+			}
+			for (int i = 0; i < fusedLength; i++) {
+				code[to + i] = fused[i];
+			}
+			to += fusedLength;
+		}
+		else {
+			memmove(&code[to], &code[from], length);
+			to += length;
+		}
+		from = next;
+	}
+	newOffsets[count] = to;
+	for (int offset = 0; offset < to; offset++) {
+		if (oldTargets[offset] == UNINITIALIZED) {
+			continue;
+		}
+		int target = newOffsets[oldTargets[offset]];
+		int jump = code[offset] == OP_LOOP ? offset + 3 - target : target - offset - 3;
+		code[offset + 1] = (jump >> 8) & 0xff;
+		code[offset + 2] = jump & 0xff;
+	}
+	chunk->count = to;
+	FREE_ARRAY(LineStart, lines, lineCapacity);
+	FREE_ARRAY(bool, landing, count + 1);
+	FREE_ARRAY(int, newOffsets, count + 1);
+	FREE_ARRAY(int, oldTargets, count);
+}
+
+int jumpTarget(Chunk* chunk, int offset) {
+	uint8_t* code = &chunk->code[offset];
+	switch (code[0]) {
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_POP_JUMP_IF_FALSE:
+	case OP_EQUAL_JUMP:
+	case OP_NOT_EQUAL_JUMP:
+	case OP_GREATER_JUMP:
+	case OP_GREATER_EQUAL_JUMP:
+	case OP_LESS_JUMP:
+	case OP_LESS_EQUAL_JUMP:
+		return offset + 3 + (code[1] << 8 | code[2]);
+	case OP_LOOP:
+		return offset + 3 - (code[1] << 8 | code[2]);
+	default:
+		return UNINITIALIZED;
+	}
+}
+
+// The most values a frame holds at once, starting with the callee and its
+// arguments. Every path to an instruction leaves the stack as high, so one
+// pass in order will do, taking the height past an unconditional jump from
+// whatever jumped there.
+int stackDepth(Chunk* chunk, int depth) {
+	int* depths = ALLOCATE(int, chunk->count + 1);
+	for (int i = 0; i <= chunk->count; i++) {
+		depths[i] = UNINITIALIZED;
+	}
+	int max = depth;
+	for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+		if (depths[offset] != UNINITIALIZED) {
+			depth = depths[offset];
+		}
+		// An array is made on top of its elements before they are taken.
+		if (chunk->code[offset] == OP_ARRAY && depth + 1 > max) {
+			max = depth + 1;
+		}
+		depth += stackEffect(chunk, offset);
+		if (depth > max) {
+			max = depth;
+		}
+		int target = jumpTarget(chunk, offset);
+		if (target > offset) {
+			depths[target] = depth;
+		}
+	}
+	FREE_ARRAY(int, depths, chunk->count + 1);
+	return max;
+}
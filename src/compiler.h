@@ -47,7 +47,7 @@ typedef struct {
 } Local;
 
 typedef struct {
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
 } Upvalue;
 
@@ -55,10 +55,20 @@ typedef struct sCompiler {
     struct sCompiler* enclosing;
     ObjFunction* function;
     FunctionType type;
-    Local locals[UINT8_COUNT];
+    Local* locals;
     int localCount;
-    Upvalue upvalues[UINT8_COUNT];
+    int localCapacity;
+    Upvalue* upvalues;
+    int upvalueCapacity;
+    ValueArray* captures; // Names a deferred body's upvalues were captured by.
+    int* constantIndex; // Open-addressed indices of the chunk's shareable constants.
+    int indexCount;
+    int indexCapacity;
     int scopeDepth;
+    int lastCompare; // Offset of the most recent comparison.
+    int lastTarget; // Offset the most recently patched jump lands on.
+    int lastCall; // Offset of the most recent call.
+    int lastConstant; // Offset of the most recent literal or constant.
 } Compiler;
 
 typedef struct sClassCompiler {
@@ -67,9 +77,10 @@ typedef struct sClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;;
 
-Compiler* current;
-ClassCompiler* currentClass;
-Parser parser;
+extern Compiler* current;
+extern ClassCompiler* currentClass;
+extern Parser parser;
 
 ObjFunction* compile(const char*);
+bool compileBody(ObjFunction*);
 void markCompilerRoots();
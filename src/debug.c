@@ -1,14 +1,121 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 static int simpleInstruction(const char*, int);
-static int constantInstruction(const char*, Chunk*, int);
+static int constantInstruction(const char*, int, Chunk*, int);
 static int byteInstruction(const char*, Chunk*, int);
+static int shortInstruction(const char*, Chunk*, int);
 static int jumpInstruction(const char*, int, Chunk*, int);
 static int invokeInstruction(const char*, Chunk*, int);
+static int propertyInstruction(const char*, int, Chunk*, int);
+static int globalInstruction(const char*, int, Chunk*, int);
+static int closureInstruction(const char*, int, Chunk*, int);
+static int readOperand(Chunk*, int, int);
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_TOP 20
+
+static void printSequences(uint64_t*, int, int);
+static int compareSequences(const void*, const void*);
+
+// Dynamic counts of every opcode pair and triple executed, for choosing
+// which sequences are worth fusing into superinstructions.
+static uint64_t pairCounts[OP_COUNT * OP_COUNT];
+static uint64_t tripleCounts[OP_COUNT * OP_COUNT * OP_COUNT];
+static uint64_t dispatchCount;
+static int lastOps[2] = { OP_COUNT, OP_COUNT };
+static uint64_t* sortCounts;
+
+static const char* opcodeNames[] = {
+	[OP_CONSTANT] = "OP_CONSTANT",
+	[OP_NIL] = "OP_NIL",
+	[OP_TRUE] = "OP_TRUE",
+	[OP_FALSE] = "OP_FALSE",
+	[OP_POP] = "OP_POP",
+	[OP_GET_LOCAL] = "OP_GET_LOCAL",
+	[OP_SET_LOCAL] = "OP_SET_LOCAL",
+	[OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+	[OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+	[OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+	[OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+	[OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+	[OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+	[OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+	[OP_GET_INDEX] = "OP_GET_INDEX",
+	[OP_SET_INDEX] = "OP_SET_INDEX",
+	[OP_GET_SUPER] = "OP_GET_SUPER",
+	[OP_EQUAL] = "OP_EQUAL",
+	[OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+	[OP_GREATER] = "OP_GREATER",
+	[OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+	[OP_LESS] = "OP_LESS",
+	[OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+	[OP_ADD] = "OP_ADD",
+	[OP_SUBTRACT] = "OP_SUBTRACT",
+	[OP_MULTIPLY] = "OP_MULTIPLY",
+	[OP_DIVIDE] = "OP_DIVIDE",
+	[OP_EXPONENTIATE] = "OP_EXPONENTIATE",
+	[OP_NOT] = "OP_NOT",
+	[OP_NEGATE] = "OP_NEGATE",
+	[OP_PRINT] = "OP_PRINT",
+	[OP_JUMP] = "OP_JUMP",
+	[OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+	[OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+	[OP_EQUAL_JUMP] = "OP_EQUAL_JUMP",
+	[OP_NOT_EQUAL_JUMP] = "OP_NOT_EQUAL_JUMP",
+	[OP_GREATER_JUMP] = "OP_GREATER_JUMP",
+	[OP_GREATER_EQUAL_JUMP] = "OP_GREATER_EQUAL_JUMP",
+	[OP_LESS_JUMP] = "OP_LESS_JUMP",
+	[OP_LESS_EQUAL_JUMP] = "OP_LESS_EQUAL_JUMP",
+	[OP_LOOP] = "OP_LOOP",
+	[OP_CALL] = "OP_CALL",
+	[OP_TAIL_CALL] = "OP_TAIL_CALL",
+	[OP_INVOKE] = "OP_INVOKE",
+	[OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+	[OP_CLOSURE] = "OP_CLOSURE",
+	[OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+	[OP_RETURN] = "OP_RETURN",
+	[OP_CLASS] = "OP_CLASS",
+	[OP_INHERIT] = "OP_INHERIT",
+	[OP_METHOD] = "OP_METHOD",
+	[OP_ARRAY] = "OP_ARRAY",
+	[OP_ARRAY_APPEND] = "OP_ARRAY_APPEND",
+	[OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+	[OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+	[OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+	[OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+	[OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+	[OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+	[OP_GET_UPVALUE_LONG] = "OP_GET_UPVALUE_LONG",
+	[OP_SET_UPVALUE_LONG] = "OP_SET_UPVALUE_LONG",
+	[OP_GET_PROPERTY_LONG] = "OP_GET_PROPERTY_LONG",
+	[OP_SET_PROPERTY_LONG] = "OP_SET_PROPERTY_LONG",
+	[OP_GET_SUPER_LONG] = "OP_GET_SUPER_LONG",
+	[OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+	[OP_CLASS_LONG] = "OP_CLASS_LONG",
+	[OP_METHOD_LONG] = "OP_METHOD_LONG",
+	[OP_EQUAL_NUMBER] = "OP_EQUAL_NUMBER",
+	[OP_NOT_EQUAL_NUMBER] = "OP_NOT_EQUAL_NUMBER",
+	[OP_GREATER_NUMBER] = "OP_GREATER_NUMBER",
+	[OP_GREATER_EQUAL_NUMBER] = "OP_GREATER_EQUAL_NUMBER",
+	[OP_LESS_NUMBER] = "OP_LESS_NUMBER",
+	[OP_LESS_EQUAL_NUMBER] = "OP_LESS_EQUAL_NUMBER",
+	[OP_ADD_NUMBER] = "OP_ADD_NUMBER",
+	[OP_SUBTRACT_NUMBER] = "OP_SUBTRACT_NUMBER",
+	[OP_MULTIPLY_NUMBER] = "OP_MULTIPLY_NUMBER",
+	[OP_DIVIDE_NUMBER] = "OP_DIVIDE_NUMBER",
+	[OP_POPN] = "OP_POPN",
+	[OP_GET_LOCAL_LOCAL] = "OP_GET_LOCAL_LOCAL",
+	[OP_GET_LOCAL_CONSTANT] = "OP_GET_LOCAL_CONSTANT",
+	[OP_GET_LOCAL_PROPERTY] = "OP_GET_LOCAL_PROPERTY",
+	[OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+	[OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+};
+#endif // DEBUG_PROFILE_OPCODES
 
 void disassembleChunk(Chunk* chunk, const char* name) {
 	printf("<%s>\n", name);
@@ -20,16 +127,17 @@ void disassembleChunk(Chunk* chunk, const char* name) {
 
 int disassembleInstruction(Chunk* chunk, int offset) {
 	printf("%04d ", offset);
-	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+	int line = getLine(chunk, offset);
+	if (offset > 0 && line == getLine(chunk, offset - 1)) {
 		printf("   | ");
 	}
 	else {
-		printf("%4d ", chunk->lines[offset]);
+		printf("%4d ", line);
 	}
 	uint8_t instruction = chunk->code[offset];
 	switch (instruction) {
 	case OP_CONSTANT:
-		return constantInstruction("OP_CONSTANT", chunk, offset);
+		return constantInstruction("OP_CONSTANT", 1, chunk, offset);
 	case OP_NIL:
 		return simpleInstruction("OP_NIL", offset);
 	case OP_TRUE:
@@ -43,31 +151,37 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 	case OP_SET_LOCAL:
 		return byteInstruction("OP_SET_LOCAL", chunk, offset);
 	case OP_GET_GLOBAL:
-		return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+		return globalInstruction("OP_GET_GLOBAL", 1, chunk, offset);
 	case OP_DEFINE_GLOBAL:
-		return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+		return globalInstruction("OP_DEFINE_GLOBAL", 1, chunk, offset);
 	case OP_SET_GLOBAL:
-		return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+		return globalInstruction("OP_SET_GLOBAL", 1, chunk, offset);
 	case OP_GET_UPVALUE:
 		return byteInstruction("OP_GET_UPVALUE", chunk, offset);
 	case OP_SET_UPVALUE:
 		return byteInstruction("OP_SET_UPVALUE", chunk, offset);
 	case OP_GET_PROPERTY:
-		return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+		return propertyInstruction("OP_GET_PROPERTY", 1, chunk, offset);
 	case OP_SET_PROPERTY:
-		return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+		return propertyInstruction("OP_SET_PROPERTY", 1, chunk, offset);
 	case OP_GET_INDEX:
 		return simpleInstruction("OP_GET_INDEX", offset);
 	case OP_SET_INDEX:
 		return simpleInstruction("OP_SET_INDEX", offset);
 	case OP_GET_SUPER:
-		return constantInstruction("OP_GET_SUPER", chunk, offset);
+		return propertyInstruction("OP_GET_SUPER", 1, chunk, offset);
 	case OP_EQUAL:
 		return simpleInstruction("OP_EQUAL", offset);
+	case OP_NOT_EQUAL:
+		return simpleInstruction("OP_NOT_EQUAL", offset);
 	case OP_GREATER:
 		return simpleInstruction("OP_GREATER", offset);
+	case OP_GREATER_EQUAL:
+		return simpleInstruction("OP_GREATER_EQUAL", offset);
 	case OP_LESS:
 		return simpleInstruction("OP_LESS", offset);
+	case OP_LESS_EQUAL:
+		return simpleInstruction("OP_LESS_EQUAL", offset);
 	case OP_ADD:
 		return simpleInstruction("OP_ADD", offset);
 	case OP_SUBTRACT:
@@ -88,41 +202,118 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 		return jumpInstruction("OP_JUMP", 1, chunk, offset);
 	case OP_JUMP_IF_FALSE:
 		return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+	case OP_POP_JUMP_IF_FALSE:
+		return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+	case OP_EQUAL_JUMP:
+		return jumpInstruction("OP_EQUAL_JUMP", 1, chunk, offset);
+	case OP_NOT_EQUAL_JUMP:
+		return jumpInstruction("OP_NOT_EQUAL_JUMP", 1, chunk, offset);
+	case OP_GREATER_JUMP:
+		return jumpInstruction("OP_GREATER_JUMP", 1, chunk, offset);
+	case OP_GREATER_EQUAL_JUMP:
+		return jumpInstruction("OP_GREATER_EQUAL_JUMP", 1, chunk, offset);
+	case OP_LESS_JUMP:
+		return jumpInstruction("OP_LESS_JUMP", 1, chunk, offset);
+	case OP_LESS_EQUAL_JUMP:
+		return jumpInstruction("OP_LESS_EQUAL_JUMP", 1, chunk, offset);
 	case OP_LOOP:
 		return jumpInstruction("OP_LOOP", -1, chunk, offset);
 	case OP_CALL:
 		return byteInstruction("OP_CALL", chunk, offset);
+	case OP_TAIL_CALL:
+		return byteInstruction("OP_TAIL_CALL", chunk, offset);
 	case OP_INVOKE:
 		return invokeInstruction("OP_INVOKE", chunk, offset);
 	case OP_SUPER_INVOKE:
 		return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-	case OP_CLOSURE: {
-		offset++;
-		uint8_t constant = chunk->code[offset++];
-		printf("%-16s %4d ", "OP_CLOSURE", constant);
-		printValue(chunk->constants.values[constant]);
-		printf("\n");
-		ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
-		for (int i = 0; i < function->upvalueCount; i++) {
-			int isLocal = chunk->code[offset++];
-			int index = chunk->code[offset++];
-			printf("%04d      |                     %s %d\n",
-				offset - 2, isLocal ? "local" : "upvalue", index);
-		}
-		return offset;
-	}
+	case OP_CLOSURE:
+		return closureInstruction("OP_CLOSURE", 1, chunk, offset);
 	case OP_CLOSE_UPVALUE:
 		return simpleInstruction("OP_CLOSE_UPVALUE", offset);
 	case OP_RETURN:
 		return simpleInstruction("OP_RETURN", offset);
 	case OP_CLASS:
-		return constantInstruction("OP_CLASS", chunk, offset);
+		return constantInstruction("OP_CLASS", 1, chunk, offset);
 	case OP_INHERIT:
 		return simpleInstruction("OP_INHERIT", offset);
 	case OP_METHOD:
-		return constantInstruction("OP_METHOD", chunk, offset);
+		return constantInstruction("OP_METHOD", 1, chunk, offset);
 	case OP_ARRAY:
 		return byteInstruction("OP_ARRAY", chunk, offset);
+	case OP_ARRAY_APPEND:
+		return byteInstruction("OP_ARRAY_APPEND", chunk, offset);
+	case OP_CONSTANT_LONG:
+		return constantInstruction("OP_CONSTANT_LONG", 3, chunk, offset);
+	case OP_GET_LOCAL_LONG:
+		return shortInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+	case OP_SET_LOCAL_LONG:
+		return shortInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+	case OP_GET_GLOBAL_LONG:
+		return globalInstruction("OP_GET_GLOBAL_LONG", 2, chunk, offset);
+	case OP_DEFINE_GLOBAL_LONG:
+		return globalInstruction("OP_DEFINE_GLOBAL_LONG", 2, chunk, offset);
+	case OP_SET_GLOBAL_LONG:
+		return globalInstruction("OP_SET_GLOBAL_LONG", 2, chunk, offset);
+	case OP_GET_UPVALUE_LONG:
+		return shortInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
+	case OP_SET_UPVALUE_LONG:
+		return shortInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+	case OP_GET_PROPERTY_LONG:
+		return propertyInstruction("OP_GET_PROPERTY_LONG", 3, chunk, offset);
+	case OP_SET_PROPERTY_LONG:
+		return propertyInstruction("OP_SET_PROPERTY_LONG", 3, chunk, offset);
+	case OP_GET_SUPER_LONG:
+		return propertyInstruction("OP_GET_SUPER_LONG", 3, chunk, offset);
+	case OP_CLOSURE_LONG:
+		return closureInstruction("OP_CLOSURE_LONG", 3, chunk, offset);
+	case OP_CLASS_LONG:
+		return constantInstruction("OP_CLASS_LONG", 3, chunk, offset);
+	case OP_METHOD_LONG:
+		return constantInstruction("OP_METHOD_LONG", 3, chunk, offset);
+	case OP_EQUAL_NUMBER:
+		return simpleInstruction("OP_EQUAL_NUMBER", offset);
+	case OP_NOT_EQUAL_NUMBER:
+		return simpleInstruction("OP_NOT_EQUAL_NUMBER", offset);
+	case OP_GREATER_NUMBER:
+		return simpleInstruction("OP_GREATER_NUMBER", offset);
+	case OP_GREATER_EQUAL_NUMBER:
+		return simpleInstruction("OP_GREATER_EQUAL_NUMBER", offset);
+	case OP_LESS_NUMBER:
+		return simpleInstruction("OP_LESS_NUMBER", offset);
+	case OP_LESS_EQUAL_NUMBER:
+		return simpleInstruction("OP_LESS_EQUAL_NUMBER", offset);
+	case OP_ADD_NUMBER:
+		return simpleInstruction("OP_ADD_NUMBER", offset);
+	case OP_SUBTRACT_NUMBER:
+		return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+	case OP_MULTIPLY_NUMBER:
+		return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+	case OP_DIVIDE_NUMBER:
+		return simpleInstruction("OP_DIVIDE_NUMBER", offset);
+	case OP_POPN:
+		return byteInstruction("OP_POPN", chunk, offset);
+	case OP_GET_LOCAL_LOCAL:
+		printf("%-16s %4d %4d\n", "OP_GET_LOCAL_LOCAL", chunk->code[offset + 1], chunk->code[offset + 2]);
+		return offset + 3;
+	case OP_GET_LOCAL_CONSTANT: {
+		uint8_t constant = chunk->code[offset + 2];
+		printf("%-16s %4d %4d '", "OP_GET_LOCAL_CONSTANT", chunk->code[offset + 1], constant);
+		printValue(chunk->constants.values[constant]);
+		printf("'\n");
+		return offset + 3;
+	}
+	case OP_GET_LOCAL_PROPERTY: {
+		uint8_t constant = chunk->code[offset + 2];
+		uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8 | chunk->code[offset + 4]);
+		printf("%-16s %4d %4d '", "OP_GET_LOCAL_PROPERTY", chunk->code[offset + 1], constant);
+		printValue(chunk->constants.values[constant]);
+		printf("' #%d\n", cache);
+		return offset + 5;
+	}
+	case OP_SET_LOCAL_POP:
+		return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+	case OP_SET_GLOBAL_POP:
+		return globalInstruction("OP_SET_GLOBAL_POP", 1, chunk, offset);
 	default:
 		printf("Unknown opcode %d\n", instruction);
 		return offset + 1;
@@ -134,12 +325,18 @@ int simpleInstruction(const char* name, int offset) {
 	return offset + 1;
 }
 
-int constantInstruction(const char* name, Chunk* chunk, int offset) {
-	uint8_t constant = chunk->code[offset + 1];
+int constantInstruction(const char* name, int width, Chunk* chunk, int offset) {
+	int constant = readOperand(chunk, offset + 1, width);
 	printf("%-16s %4d '", name, constant);
 	printValue(chunk->constants.values[constant]);
 	printf("'\n");
-	return offset + 2;
+	return offset + 1 + width;
+}
+
+int globalInstruction(const char* name, int width, Chunk* chunk, int offset) {
+	int slot = readOperand(chunk, offset + 1, width);
+	printf("%-16s %4d '%s'\n", name, slot, globalName(slot)->data);
+	return offset + 1 + width;
 }
 
 int byteInstruction(const char* name, Chunk* chunk, int offset) {
@@ -148,6 +345,11 @@ int byteInstruction(const char* name, Chunk* chunk, int offset) {
 	return offset + 2;
 }
 
+int shortInstruction(const char* name, Chunk* chunk, int offset) {
+	printf("%-16s %4d\n", name, readOperand(chunk, offset + 1, 2));
+	return offset + 3;
+}
+
 int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
 	uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
 	jump |= chunk->code[offset + 2];
@@ -158,8 +360,98 @@ int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
 int invokeInstruction(const char* name, Chunk* chunk, int offset) {
 	uint8_t constant = chunk->code[offset + 1];
 	uint8_t argCount = chunk->code[offset + 2];
+	uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8 | chunk->code[offset + 4]);
 	printf("%-16s (%d args) %4d '", name, argCount, constant);
 	printValue(chunk->constants.values[constant]);
-	printf("'\n");
-	return offset + 2;
+	printf("' #%d\n", cache);
+	return offset + 5;
+}
+
+int propertyInstruction(const char* name, int width, Chunk* chunk, int offset) {
+	int constant = readOperand(chunk, offset + 1, width);
+	int cache = readOperand(chunk, offset + 1 + width, 2);
+	printf("%-16s %4d '", name, constant);
+	printValue(chunk->constants.values[constant]);
+	printf("' #%d\n", cache);
+	return offset + 3 + width;
+}
+
+int closureInstruction(const char* name, int width, Chunk* chunk, int offset) {
+	int constant = readOperand(chunk, offset + 1, width);
+	printf("%-16s %4d ", name, constant);
+	printValue(chunk->constants.values[constant]);
+	printf("\n");
+	ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+	offset += 1 + width;
+	for (int i = 0; i < function->upvalueCount; i++) {
+		int flags = chunk->code[offset];
+		int indexWidth = flags & UPVALUE_LONG ? 2 : 1;
+		printf("%04d      |                     %s %d\n",
+			offset, flags & UPVALUE_LOCAL ? "local" : "upvalue", readOperand(chunk, offset + 1, indexWidth));
+		offset += 1 + indexWidth;
+	}
+	return offset;
+}
+
+// Reads a big-endian operand of the given width in bytes.
+int readOperand(Chunk* chunk, int offset, int width) {
+	int operand = 0;
+	for (int i = 0; i < width; i++) {
+		operand = operand << 8 | chunk->code[offset + i];
+	}
+	return operand;
+}
+
+#ifdef DEBUG_PROFILE_OPCODES
+void profileOpcode(uint8_t op) {
+	dispatchCount++;
+	if (lastOps[1] != OP_COUNT) {
+		pairCounts[lastOps[1] * OP_COUNT + op]++;
+		if (lastOps[0] != OP_COUNT) {
+			tripleCounts[(lastOps[0] * OP_COUNT + lastOps[1]) * OP_COUNT + op]++;
+		}
+	}
+	lastOps[0] = lastOps[1];
+	lastOps[1] = op;
+}
+
+void printOpcodeProfile() {
+	printf("Opcode profile: %llu dispatches\n", (unsigned long long)dispatchCount);
+	printf("Pairs:\n");
+	printSequences(pairCounts, OP_COUNT * OP_COUNT, 2);
+	printf("Triples:\n");
+	printSequences(tripleCounts, OP_COUNT * OP_COUNT * OP_COUNT, 3);
+}
+
+void printSequences(uint64_t* counts, int count, int length) {
+	int* order = malloc(sizeof(int) * count);
+	if (!order) {
+		return;
+	}
+	int used = 0;
+	for (int i = 0; i < count; i++) {
+		if (counts[i]) {
+			order[used++] = i;
+		}
+	}
+	sortCounts = counts;
+	qsort(order, used, sizeof(int), compareSequences);
+	for (int i = 0; i < used && i < PROFILE_TOP; i++) {
+		printf("%12llu %5.1f%% ", (unsigned long long)counts[order[i]], 100.0 * counts[order[i]] / dispatchCount);
+		int ops[3];
+		for (int j = length - 1, sequence = order[i]; j >= 0; j--, sequence /= OP_COUNT) {
+			ops[j] = sequence % OP_COUNT;
+		}
+		for (int j = 0; j < length; j++) {
+			printf(" %s", opcodeNames[ops[j]]);
+		}
+		printf("\n");
+	}
+	free(order);
+}
+
+int compareSequences(const void* a, const void* b) {
+	uint64_t countA = sortCounts[*(const int*)a], countB = sortCounts[*(const int*)b];
+	return countA < countB ? 1 : countA > countB ? -1 : 0;
 }
+#endif // DEBUG_PROFILE_OPCODES
@@ -4,3 +4,8 @@
 
 void disassembleChunk(Chunk*, const char*);
 int disassembleInstruction(Chunk*, int);
+
+#ifdef DEBUG_PROFILE_OPCODES
+void profileOpcode(uint8_t);
+void printOpcodeProfile();
+#endif // DEBUG_PROFILE_OPCODES
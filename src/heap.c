@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif // _MSC_VER
+
+static Page* newPage(int, size_t);
+static void* allocatePage(size_t);
+static void releasePage(Page*);
+
+void initHeap() {
+	for (int i = 0; i < HEAP_CLASSES; i++) {
+		vm.heap[i].first = NULL;
+		vm.heap[i].last = NULL;
+		vm.heap[i].allocPage = NULL;
+	}
+}
+
+// Cells are taken from the first page found with any free. Sweeping may
+// free some in pages already passed, which are only looked at again once it
+// is done. Nothing is collected from here, so there is no recovering from a
+// page that cannot be had.
+Obj* allocateCell(size_t size) {
+	size = ALIGN(size);
+	if (size > MAX_CELL_SIZE) {
+		Page* page = newPage(SIZE_CLASSES, size);
+		if (!page) {
+			outOfMemory();
+		}
+		page->freeList = NULL;
+		page->freeCount = 0;
+		int granule = granuleOf((Obj*)page->cells);
+		page->allocated[granule / 64] |= (uint64_t)1 << (granule % 64);
+		return (Obj*)page->cells;
+	}
+	SizeClass* sizeClass = &vm.heap[size / ALIGNMENT - 1];
+	while (sizeClass->allocPage && !sizeClass->allocPage->freeList) {
+		sizeClass->allocPage = sizeClass->allocPage->next;
+	}
+	if (!sizeClass->allocPage) {
+		sizeClass->allocPage = newPage((int)(size / ALIGNMENT - 1), size);
+		if (!sizeClass->allocPage) {
+			outOfMemory();
+		}
+	}
+	Page* page = sizeClass->allocPage;
+	Obj* object = page->freeList;
+	page->freeList = *(void**)object;
+	page->freeCount--;
+	int granule = granuleOf(object);
+	page->allocated[granule / 64] |= (uint64_t)1 << (granule % 64);
+	return object;
+}
+
+// Freed cells go on the front of the page's list. Emptied pages are left to
+// whoever is sweeping, which may be one of several threads.
+void freeCell(Obj* object) {
+	Page* page = pageOf(object);
+	int granule = granuleOf(object);
+	page->allocated[granule / 64] &= ~((uint64_t)1 << (granule % 64));
+	*(void**)object = page->freeList;
+	page->freeList = object;
+	page->freeCount++;
+}
+
+void freePage(Page* page) {
+	SizeClass* sizeClass = &vm.heap[page->sizeClass];
+	if (sizeClass->allocPage == page) {
+		sizeClass->allocPage = page->next;
+	}
+	if (page->prev) {
+		page->prev->next = page->next;
+	}
+	else {
+		sizeClass->first = page->next;
+	}
+	if (page->next) {
+		page->next->prev = page->prev;
+	}
+	else {
+		sizeClass->last = page->prev;
+	}
+	releasePage(page);
+}
+
+// Once a sweep is done, the pages it freed cells in are looked through again.
+void rewindHeap() {
+	for (int i = 0; i < SIZE_CLASSES; i++) {
+		vm.heap[i].allocPage = vm.heap[i].first;
+	}
+}
+
+Obj* firstObject() {
+	for (int i = 0; i < HEAP_CLASSES; i++) {
+		Page* page = vm.heap[i].first;
+		while (page) {
+			if (page->freeCount < page->cellCount) {
+				for (int j = 0; ; j++) {
+					Obj* object = cellAt(page, j);
+					if (isAllocated(page, granuleOf(object))) {
+						return object;
+					}
+				}
+			}
+			page = page->next;
+		}
+	}
+	return NULL;
+}
+
+// Objects follow in the order of their pages, then of their addresses.
+Obj* nextObject(Obj* object) {
+	Page* page = pageOf(object);
+	int index = (int)(((uint8_t*)object - page->cells) / page->cellSize) + 1;
+	int sizeClass = page->sizeClass;
+	while (true) {
+		for (; index < page->cellCount; index++) {
+			Obj* next = cellAt(page, index);
+			if (isAllocated(page, granuleOf(next))) {
+				return next;
+			}
+		}
+		page = page->next;
+		while (!page) {
+			if (++sizeClass == HEAP_CLASSES) {
+				return NULL;
+			}
+			page = vm.heap[sizeClass].first;
+		}
+		index = 0;
+	}
+}
+
+void freeHeap() {
+	for (int i = 0; i < HEAP_CLASSES; i++) {
+		Page* page = vm.heap[i].first;
+		while (page) {
+			Page* next = page->next;
+			releasePage(page);
+			page = next;
+		}
+	}
+	initHeap();
+}
+
+// Pages are linked in last, and have every cell on their free list, in
+// address order. A large object's page is as long as it needs to be.
+Page* newPage(int sizeClass, size_t cellSize) {
+	size_t offset = ALIGN(sizeof(Page));
+	size_t size = sizeClass == SIZE_CLASSES ? offset + cellSize : PAGE_SIZE;
+	Page* page = allocatePage(size);
+	if (!page) {
+		return NULL;
+	}
+	page->sizeClass = sizeClass;
+	page->cellSize = (int)cellSize;
+	page->cellCount = (int)((size - offset) / cellSize);
+	page->freeCount = page->cellCount;
+	page->cells = (uint8_t*)page + offset;
+	page->freeList = NULL;
+	for (int i = page->cellCount - 1; i >= 0; i--) {
+		Obj* cell = cellAt(page, i);
+		*(void**)cell = page->freeList;
+		page->freeList = cell;
+	}
+	memset(page->allocated, 0, sizeof(page->allocated));
+	memset(page->marks, 0, sizeof(page->marks));
+	SizeClass* heap = &vm.heap[sizeClass];
+	page->prev = heap->last;
+	page->next = NULL;
+	if (heap->last) {
+		heap->last->next = page;
+	}
+	else {
+		heap->first = page;
+	}
+	heap->last = page;
+	return page;
+}
+
+void* allocatePage(size_t size) {
+#ifdef _MSC_VER
+	return _aligned_malloc(size, PAGE_SIZE);
+#else
+	void* page = NULL;
+	return posix_memalign(&page, PAGE_SIZE, size) ? NULL : page;
+#endif // _MSC_VER
+}
+
+void releasePage(Page* page) {
+#ifdef _MSC_VER
+	_aligned_free(page);
+#else
+	free(page);
+#endif // _MSC_VER
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif // _MSC_VER
+
+#define ALIGNMENT 8
+#define ALIGN(size) (((size) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+#define PAGE_SIZE 0x8000
+#define MAX_CELL_SIZE 0x100 // Larger objects are given a page each.
+#define SIZE_CLASSES (MAX_CELL_SIZE / ALIGNMENT)
+#define HEAP_CLASSES (SIZE_CLASSES + 1) // The last holds the large objects.
+#define BITMAP_WORDS (PAGE_SIZE / ALIGNMENT / 64)
+
+// Old objects live in cells of pages given over to one size. Pages are
+// aligned to PAGE_SIZE, so that an object's can be found from its address.
+typedef struct sPage {
+	struct sPage* prev;
+	struct sPage* next;
+	int sizeClass;
+	int cellSize;
+	int cellCount;
+	int freeCount;
+	void* freeList;
+	uint8_t* cells;
+	// A bit for each ALIGNMENT bytes of the page, at the start of each cell.
+	uint64_t allocated[BITMAP_WORDS];
+	uint64_t marks[BITMAP_WORDS]; // Meaningful only where allocated.
+} Page;
+
+typedef struct {
+	Page* first;
+	Page* last;
+	Page* allocPage; // Where cells are next looked for.
+} SizeClass;
+
+void initHeap();
+Obj* allocateCell(size_t);
+void freeCell(Obj*);
+void freePage(Page*);
+void rewindHeap();
+Obj* firstObject();
+Obj* nextObject(Obj*);
+void freeHeap();
+
+static inline Page* pageOf(Obj* object) {
+	return (Page*)((uintptr_t)object & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static inline int granuleOf(Obj* object) {
+	return (int)(((uintptr_t)object & (PAGE_SIZE - 1)) / ALIGNMENT);
+}
+
+static inline bool isAllocated(Page* page, int granule) {
+	return page->allocated[granule / 64] >> (granule % 64) & 1;
+}
+
+static inline Obj* cellAt(Page* page, int index) {
+	return (Obj*)(page->cells + (size_t)index * page->cellSize);
+}
+
+static inline Obj* granuleAt(Page* page, int granule) {
+	return (Obj*)((uint8_t*)page + (size_t)granule * ALIGNMENT);
+}
+
+static inline int bitCount(uint64_t word) {
+#ifdef _MSC_VER
+	return (int)__popcnt64(word);
+#else
+	return __builtin_popcountll(word);
+#endif // _MSC_VER
+}
+
+// Of a word that is not 0.
+static inline int highestBit(uint64_t word) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, word);
+	return (int)index;
+#else
+	return 63 - __builtin_clzll(word);
+#endif // _MSC_VER
+}
@@ -2,13 +2,26 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bytecode.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "snapshot.h"
 #include "vm.h"
 
-#define REPL 1
-#define SOURCE 2
+#define MAX_FRAMES_OPTION "--max-frames="
+#define GC_STEP_OPTION "--gc-step="
+#define GC_THREADS_OPTION "--gc-threads="
+#define CONCURRENT_GC_OPTION "--concurrent-gc"
+#define GC_OVERHEAD_OPTION "--gc-overhead="
+#define HEAP_LIMIT_OPTION "--heap-limit="
+#define COMPILE_OPTION "--compile"
+#define LAZY_OPTION "--lazy"
+#define SNAPSHOT_OPTION "--snapshot="
+#define IMAGE_OPTION "--image="
+#define SOURCE_EXTENSION ".lox"
+#define BYTECODE_EXTENSION ".loxc"
 #define LINE_MAX 1024
 #define READ "rb"
 #define EX_USAGE 64
@@ -16,26 +29,105 @@
 #define EX_SOFTWARE 70
 #define EX_IOERR 74
 
+static void parseOption(const char*);
+static void usage();
 static void repl();
 static void runFile(const char*);
+static void compileFile(const char*);
 static char* readFile(const char*);
 
+static bool compileOnly = false;
+static const char* snapshotPath = NULL;
+static const char* imagePath = NULL;
+
 int main(int argc, const char* argv[]) {
 	initVM();
-	if (argc == REPL) {
+	int arg = 1;
+	while (arg < argc && argv[arg][0] == '-') {
+		parseOption(argv[arg++]);
+	}
+	if (imagePath && !readSnapshot(imagePath)) {
+		exit(EX_DATAERR);
+	}
+	if (arg == argc && !compileOnly) {
 		repl();
 	}
-	else if (argc == SOURCE) {
-		runFile(argv[1]);
+	else if (arg == argc - 1 && compileOnly) {
+		compileFile(argv[arg]);
+	}
+	else if (arg == argc - 1) {
+		runFile(argv[arg]);
 	}
 	else {
-		fprintf(stderr, "Usage: lox [path]\n");
-		exit(EX_USAGE);
+		usage();
+	}
+	if (snapshotPath && !writeSnapshot(snapshotPath)) {
+		fprintf(stderr, "Could not write file \"%s\".\n", snapshotPath);
+		exit(EX_IOERR);
 	}
 	freeVM();
+	unmapBytecode();
 	return 0;
 }
 
+void parseOption(const char* option) {
+	size_t length = strlen(MAX_FRAMES_OPTION);
+	if (!strncmp(option, MAX_FRAMES_OPTION, length) && atoi(option + length) > 0) {
+		vm.framesMax = atoi(option + length);
+		return;
+	}
+	length = strlen(GC_STEP_OPTION);
+	if (!strncmp(option, GC_STEP_OPTION, length) && atoi(option + length) > 0) {
+		vm.gcStepWork = atoi(option + length);
+		return;
+	}
+	length = strlen(GC_THREADS_OPTION);
+	if (!strncmp(option, GC_THREADS_OPTION, length) && atoi(option + length) > 0) {
+		int threads = atoi(option + length);
+		vm.gcThreads = threads < GC_THREADS_MAX ? threads : GC_THREADS_MAX;
+		return;
+	}
+	if (!strcmp(option, CONCURRENT_GC_OPTION)) {
+		vm.concurrentGC = true;
+		return;
+	}
+	length = strlen(GC_OVERHEAD_OPTION);
+	if (!strncmp(option, GC_OVERHEAD_OPTION, length) && atoi(option + length) > 0) {
+		vm.gcOverhead = atoi(option + length);
+		return;
+	}
+	// In megabytes.
+	length = strlen(HEAP_LIMIT_OPTION);
+	if (!strncmp(option, HEAP_LIMIT_OPTION, length) && atoi(option + length) > 0) {
+		vm.heapLimit = (size_t)atoi(option + length) << 20;
+		return;
+	}
+	if (!strcmp(option, COMPILE_OPTION)) {
+		compileOnly = true;
+		return;
+	}
+	if (!strcmp(option, LAZY_OPTION)) {
+		vm.lazyCompile = true;
+		return;
+	}
+	length = strlen(SNAPSHOT_OPTION);
+	if (!strncmp(option, SNAPSHOT_OPTION, length) && option[length]) {
+		snapshotPath = option + length;
+		return;
+	}
+	length = strlen(IMAGE_OPTION);
+	if (!strncmp(option, IMAGE_OPTION, length) && option[length]) {
+		imagePath = option + length;
+		return;
+	}
+	usage();
+}
+
+void usage() {
+	fprintf(stderr, "Usage: lox [%sN] [%sN] [%sN] [%s] [%sN] [%sN] [%s] [%s] [%spath] [%spath] [path]\n", MAX_FRAMES_OPTION, GC_STEP_OPTION, GC_THREADS_OPTION, CONCURRENT_GC_OPTION, GC_OVERHEAD_OPTION, HEAP_LIMIT_OPTION, COMPILE_OPTION, LAZY_OPTION, SNAPSHOT_OPTION, IMAGE_OPTION);
+	exit(EX_USAGE);
+}
+
 void repl() {
 	char line[LINE_MAX];
 	while (true) {
@@ -49,9 +141,19 @@ void repl() {
 }
 
 void runFile(const char* path) {
-	char* source = readFile(path);
-	InterpretResult result = interpret(source);
-	free(source);
+	InterpretResult result;
+	if (isBytecode(path)) {
+		ObjFunction* function = readBytecode(path);
+		if (!function) {
+			exit(EX_DATAERR);
+		}
+		result = interpretFunction(function);
+	}
+	else {
+		char* source = readFile(path);
+		result = interpret(source);
+		free(source);
+	}
 	if (result == INTERPRET_COMPILE_ERROR) {
 		exit(EX_DATAERR);
 	}
@@ -60,6 +162,35 @@ void runFile(const char* path) {
 	}
 }
 
+// Writes path's bytecode alongside it, replacing a .lox extension with .loxc.
+void compileFile(const char* path) {
+	char* source = readFile(path);
+	vm.lazyCompile = false; // Bytecode files hold every body.
+	vm.wideGlobals = true; // And may be run where their globals' slots are higher.
+	ObjFunction* function = compile(source);
+	free(source);
+	if (!function) {
+		exit(EX_DATAERR);
+	}
+	size_t length = strlen(path);
+	size_t extension = strlen(SOURCE_EXTENSION);
+	if (length >= extension && !strcmp(path + length - extension, SOURCE_EXTENSION)) {
+		length -= extension;
+	}
+	char* output = malloc(length + strlen(BYTECODE_EXTENSION) + 1);
+	if (!output) {
+		fprintf(stderr, "Not enough memory to compile \"%s\".\n", path);
+		exit(EX_IOERR);
+	}
+	memcpy(output, path, length);
+	strcpy(output + length, BYTECODE_EXTENSION);
+	if (!writeBytecode(function, output)) {
+		fprintf(stderr, "Could not write file \"%s\".\n", output);
+		exit(EX_IOERR);
+	}
+	free(output);
+}
+
 char* readFile(const char* path) {
 	FILE* file = fopen(path, READ);
 	if (!file) {
@@ -1,4 +1,8 @@
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "common.h"
 #include "compiler.h"
@@ -7,54 +11,342 @@
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif // DEBUG_LOG_GC
 
-#define GC_HEAP_SHIFT 1
+#ifdef CONCURRENT_GC
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#endif // CONCURRENT_GC
+
+#define EX_SOFTWARE 70
+#define GC_STEP_SIZE 0x4000 // Bytes allocated between steps of a collection.
+#define MARKER_BATCH 0x100 // Objects the marker traces between letting the mutator in.
+#define SHARE_THRESHOLD 0x40 // Gray objects a worker keeps to itself while others are idle.
+// Where a promoted young object keeps its copy's address, past the header.
+#define FORWARD(object) (*(Obj**)((uint8_t*)(object) + sizeof(Obj*)))
 
+static void account(size_t, size_t);
+static void enforceLimit(size_t);
+static void collectStep();
+static void collect(int);
+static double now();
+static void beginCollection();
+static void finishMarking();
+static void endCollection();
+static void pace();
 static void markRoots();
-static void traceReferences();
+static void markNursery();
+static void markOverwritten();
+static void pushGray(Obj*);
+static int traceReferences(int);
 static void blackenObject(Obj*);
 static void markArray(ValueArray*);
-static void sweep();
+static void markCaches(Chunk*);
+static void forgetWhite();
+static bool sweep(int);
+static int sweepPage(Page*, bool);
+static void promoteRoots();
+static Obj* promote(Obj*);
+static Value promoteValue(Value);
+static void promoteReferences(Obj*);
+static void promoteTable(Table*);
+static void releaseNursery();
+static size_t objectSize(Obj*);
 static void freeObject(Obj*);
+static void releaseObject(Obj*);
+#ifdef CONCURRENT_GC
+static void startMarker();
+static bool handOff(bool);
+static void stopMarker();
+static void* markConcurrently(void*);
+
+// A thread marking or sweeping for a collection done at once. What it grays
+// goes on a stack of its own. While others are idle it moves half of that to
+// a shared stack, which they may steal from.
+typedef struct {
+	int count;
+	int capacity;
+	Obj** stack;
+	pthread_mutex_t lock; // Guards the shared stack.
+	int sharedCount;
+	int sharedCapacity;
+	Obj** shared;
+	size_t freed; // Only the mutator keeps vm.bytesAllocated.
+	int generation;
+	pthread_t thread;
+} Worker;
+
+typedef void (*Task)(Worker*);
+
+static void traceInParallel();
+static bool sweepInParallel();
+static void runInParallel(Task);
+static void startWorkers();
+static void stopWorkers();
+static void* runWorker(void*);
+static void markShared(Worker*);
+static void shareGray(Worker*);
+static bool stealGray(Worker*);
+static bool takeGray(Worker*, Worker*);
+static void pruneStrings(Worker*);
+static void sweepShared(Worker*);
+#endif // CONCURRENT_GC
+
+// Survivors of a minor collection still to be scanned.
+static int promotedCount = 0;
+static int promotedCapacity = 0;
+static Obj** promoted = NULL;
+// What the collection under way began with, and what has been added since.
+static size_t bytesBefore = 0;
+static size_t bytesDuring = 0;
+#ifdef CONCURRENT_GC
+static pthread_t marker;
+static bool markerStarted = false;
+static pthread_mutex_t heapMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markerWake = PTHREAD_COND_INITIALIZER;
+// Guarded by heapMutex. The marker traces only while marking is set.
+static bool marking = false;
+static bool markerExit = false;
+// Set while the mutator waits on heapMutex, so that the marker steps aside.
+static atomic_bool mutatorWaiting;
+// The mutator is the first worker, so only gcThreads - 1 threads are started.
+static Worker workers[GC_THREADS_MAX];
+static int workerCount = 0;
+static _Thread_local Worker* self = NULL;
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+// Guarded by poolMutex.
+static Task task;
+static int taskGeneration = 0;
+static int tasksRunning = 0;
+static bool poolExit = false;
+static atomic_int idleWorkers;
+static atomic_int nextPage;
+// What a parallel sweep shares out.
+static Page** sweepPages = NULL;
+static int sweepPageCount = 0;
+static int sweepPageCapacity = 0;
+#endif // CONCURRENT_GC
 
 void* reallocate(void* previous, size_t oldSize, size_t newSize) {
+#ifdef CONCURRENT_GC
+	// Workers only ever free, sweeping.
+	if (self) {
+		self->freed += oldSize;
+		free(previous);
+		return NULL;
+	}
+#endif // CONCURRENT_GC
+	account(oldSize, newSize);
+	if (newSize == 0) {
+		free(previous);
+		return NULL;
+	}
+	void* result = realloc(previous, newSize);
+	if (!result) {
+		// Callers that can fail cleanly leave the heap as it was.
+		vm.bytesAllocated -= newSize - oldSize;
+	}
+	return result;
+}
+
+// Growth may be followed by a step of a collection.
+void account(size_t oldSize, size_t newSize) {
+	if (newSize > oldSize && vm.heapLimit && vm.bytesAllocated + (newSize - oldSize) > vm.heapLimit) {
+		enforceLimit(newSize - oldSize);
+	}
 	vm.bytesAllocated += newSize - oldSize;
-	if (newSize > oldSize) {
+	if (newSize > oldSize && vm.gcPhase != GC_IDLE) {
+		bytesDuring += newSize - oldSize;
+	}
+	if (newSize > oldSize && !vm.heapLocks) {
 #ifdef DEBUG_STRESS_GC
 		collectGarbage();
 	}
 #else
 		if (vm.bytesAllocated > vm.nextGC) {
-			collectGarbage();
+			collectStep();
 		}
 	}
 #endif // DEBUG_STRESS_GC
-	if (newSize == 0) {
-		free(previous);
+}
+
+// For what the interpreter cannot go on without.
+void outOfMemory() {
+	fprintf(stderr, "Out of memory.\n");
+	exit(EX_SOFTWARE);
+}
+
+// Nothing goes past the heap limit without everything unreachable being
+// collected first. Allocations made with the heap locked are let through, to
+// be held to it by the next.
+void enforceLimit(size_t size) {
+	if (vm.heapLocks) {
+		return;
+	}
+	collectGarbage();
+	if (vm.bytesAllocated + size > vm.heapLimit) {
+		fprintf(stderr, "Heap limit of %zu bytes exceeded.\n", vm.heapLimit);
+		exit(EX_SOFTWARE);
+	}
+}
+
+// Young objects are bumped out of the nursery and never freed one by one; a
+// minor collection copies out those still reachable and empties it. NULL once
+// it is full, until run() reaches a safe point.
+Obj* allocateYoung(size_t size) {
+	size = ALIGN(size);
+	if (vm.nurseryTop + size > vm.nursery + NURSERY_SIZE) {
 		return NULL;
 	}
-	return realloc(previous, newSize);
+	Obj* object = (Obj*)vm.nurseryTop;
+	vm.nurseryTop += size;
+	object->isRemembered = false;
+	object->isForwarded = false;
+	return object;
 }
 
+// Where objects go while the nursery is full. They are remembered, as they
+// may well be given young references before the next minor collection, and
+// born marked, so that a collection under way leaves them be.
+Obj* allocateOld(size_t size) {
+	account(0, size);
+	Obj* object = allocateCell(size);
+	setMarked(object);
+	object->isRemembered = false;
+	object->isForwarded = false;
+	rememberObject(object);
+	return object;
+}
+
+// Finishes any collection under way, then collects everything unreachable
+// now.
 void collectGarbage() {
+	if (vm.gcPhase != GC_IDLE) {
+		collect(INT_MAX);
+	}
+	collect(INT_MAX);
+}
+
+// Collections are spread over allocations, a step every GC_STEP_SIZE bytes,
+// unless they are to be done at once by several threads.
+void collectStep() {
+#ifdef CONCURRENT_GC
+	if (vm.gcThreads > 1 && !vm.concurrentGC) {
+		collect(INT_MAX);
+		return;
+	}
+#endif // CONCURRENT_GC
+	collect(vm.gcStepWork);
+	if (vm.gcPhase != GC_IDLE) {
+		vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+	}
+}
+
+// Marks, then sweeps, until the collection is done or the work runs out.
+void collect(int work) {
+	double start = now();
+	if (vm.gcPhase == GC_IDLE) {
+		beginCollection();
+	}
+	bool tracing = vm.gcPhase == GC_MARK;
+#ifdef CONCURRENT_GC
+	// The marker thread does the tracing, unless it runs out of objects or the
+	// collection is to be finished now.
+	if (vm.markerActive) {
+		tracing = handOff(work == INT_MAX);
+	}
+#endif // CONCURRENT_GC
+	if (tracing) {
+		markOverwritten();
+		work = traceReferences(work);
+		if (!vm.grayCount) {
+			finishMarking();
+		}
+	}
+	bool done = vm.gcPhase == GC_SWEEP && sweep(work);
+	double pause = now() - start;
+	if (pause > vm.gcPause) {
+		vm.gcPause = pause;
+	}
+	if (done) {
+		endCollection();
+	}
+}
+
+// Wall time in seconds, as processor time would count the marker thread's.
+double now() {
+	struct timespec time;
+	timespec_get(&time, TIME_UTC);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Flipping what counts as marked leaves every old object unmarked at once.
+void beginCollection() {
 #ifdef DEBUG_LOG_GC
 	printf("-- gc begin\n");
-	size_t before = vm.bytesAllocated;
 #endif // DEBUG_LOG_GC
+	bytesBefore = vm.bytesAllocated;
+	bytesDuring = 0;
+	vm.markBit = !vm.markBit;
+	vm.gcPhase = GC_MARK;
 	markRoots();
-	traceReferences();
-	tableRemoveWhite(&vm.strings);
-	sweep();
-	vm.nextGC = vm.bytesAllocated << GC_HEAP_SHIFT;
+}
+
+// The roots and young objects are written to without a barrier, so are traced
+// again before anything is swept.
+void finishMarking() {
+	markRoots();
+	markOverwritten();
+	traceReferences(INT_MAX);
+	forgetWhite();
+	vm.sweepClass = 0;
+	vm.sweepPage = vm.heap[0].first;
+	vm.gcPhase = GC_SWEEP;
+}
+
+void endCollection() {
+	vm.gcPhase = GC_IDLE;
+	rewindHeap();
+	pace();
+	vm.maxPause = vm.gcPause;
+	vm.gcPause = 0;
 #ifdef DEBUG_LOG_GC
 	printf("-- gc end\n");
-	printf("   collect %ld bytes (from %ld to %ld) next at %ld\n", before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+	printf("   collect %ld bytes (from %ld to %ld) next at %ld\n", bytesBefore + bytesDuring - vm.bytesAllocated, bytesBefore, vm.bytesAllocated, vm.nextGC);
+	printf("   survival %.2f allocation rate %.2f\n", vm.survivalRatio, vm.allocationRate);
+	printf("   longest pause %.3f ms\n", vm.maxPause * 1000);
 #endif // DEBUG_LOG_GC
 }
 
+// The heap is let grow gcOverhead percent past what survived, less what is
+// expected to be allocated while the next collection runs, so that it ends
+// near that. A collection traces what survives it, which is the survival
+// ratio of the heap it begins with, and the script allocates in proportion.
+// Both are averaged over recent collections, and the result kept under the
+// heap limit.
+void pace() {
+	// What was allocated during the collection was not swept.
+	size_t survived = vm.bytesAllocated > bytesDuring ? vm.bytesAllocated - bytesDuring : 0;
+	double survival = bytesBefore ? (double)survived / bytesBefore : 1;
+	double rate = survived ? (double)bytesDuring / survived : 0;
+	vm.survivalRatio = (vm.survivalRatio + (survival < 1 ? survival : 1)) / 2;
+	vm.allocationRate = (vm.allocationRate + rate) / 2;
+	size_t goal = vm.bytesAllocated + vm.bytesAllocated / 100 * vm.gcOverhead;
+	if (vm.heapLimit && goal > vm.heapLimit) {
+		goal = vm.heapLimit;
+	}
+	vm.nextGC = (size_t)(goal / (1 + vm.survivalRatio * vm.allocationRate));
+	size_t floor = vm.heapLimit && vm.heapLimit < GC_MIN_HEAP ? vm.heapLimit : GC_MIN_HEAP;
+	if (vm.nextGC < floor) {
+		vm.nextGC = floor;
+	}
+}
+
 void markRoots() {
 	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
 		markValue(*slot);
@@ -65,9 +357,20 @@ void markRoots() {
 	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue; upvalue = upvalue->next) {
 		markObject((Obj*)upvalue);
 	}
-	markTable(&vm.globals);
+	markTable(&vm.globalSlots);
+	markArray(&vm.globals);
 	markCompilerRoots();
 	markObject((Obj*)vm.initString);
+	markNursery();
+}
+
+// Major collections do not move objects, so they can run from any
+// allocation, but neither do they free young ones. Every young object is
+// instead taken as a root, and the nursery left to minor collections.
+void markNursery() {
+	for (uint8_t* cell = vm.nursery; cell < vm.nurseryTop; cell += ALIGN(objectSize((Obj*)cell))) {
+		blackenObject((Obj*)cell);
+	}
 }
 
 void markValue(Value value) {
@@ -78,7 +381,12 @@ void markValue(Value value) {
 }
 
 void markObject(Obj* object) {
-	if (!object || object->isMarked) {
+	if (!object || isYoung(object) || isMarked(object)) {
+		return;
+	}
+	// Workers marking in parallel may reach an object at once. Only the one
+	// that marks it grays it.
+	if (setMarked(object)) {
 		return;
 	}
 #ifdef DEBUG_LOG_GC
@@ -86,27 +394,50 @@ void markObject(Obj* object) {
 	printValue(OBJ_VAL(object));
 	printf("\n");
 #endif // DEBUG_LOG_GC
-	object->isMarked = true;
-	if (vm.grayCapacity < vm.grayCount + 1) {
+	pushGray(object);
+}
+
+void pushGray(Obj* object) {
+	Obj*** stack = &vm.grayStack;
+	int* count = &vm.grayCount;
+	int* capacity = &vm.grayCapacity;
+#ifdef CONCURRENT_GC
+	if (self) {
+		stack = &self->stack;
+		count = &self->count;
+		capacity = &self->capacity;
+	}
+#endif // CONCURRENT_GC
+	if (*capacity < *count + 1) {
 		Obj** temp = NULL;
-		vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-		temp = realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+		*capacity = GROW_CAPACITY(*capacity);
+		temp = realloc(*stack, sizeof(Obj*) * *capacity);
 		if (temp) {
-			vm.grayStack = temp;
+			*stack = temp;
 			temp = NULL;
 		}
 		else {
-			// TODO error
+			// Dropping the object would leave what it refers to unmarked.
+			outOfMemory();
 		}
 	}
-	vm.grayStack[vm.grayCount++] = object; // TODO do not add strings and natives to the gray stack
+	(*stack)[(*count)++] = object; // TODO do not add strings and natives to the gray stack
 }
 
-void traceReferences() {
-	while (vm.grayCount) {
+// Returns what is left of the work.
+int traceReferences(int work) {
+#ifdef CONCURRENT_GC
+	if (work == INT_MAX && vm.gcThreads > 1) {
+		traceInParallel();
+		return work;
+	}
+#endif // CONCURRENT_GC
+	while (vm.grayCount && work > 0) {
 		Obj* object = vm.grayStack[--vm.grayCount];
 		blackenObject(object);
+		work--;
 	}
+	return work;
 }
 
 void blackenObject(Obj* object) {
@@ -125,7 +456,9 @@ void blackenObject(Obj* object) {
 	case OBJ_FUNCTION: {
 		ObjFunction* function = (ObjFunction*)object;
 		markObject((Obj*)function->name);
+		markObject((Obj*)function->source);
 		markArray(&function->chunk.constants);
+		markCaches(&function->chunk);
 		break;
 	}
 	case OBJ_CLOSURE: {
@@ -140,6 +473,7 @@ void blackenObject(Obj* object) {
 		ObjClass* cls = (ObjClass*)object;
 		markObject((Obj*)cls->name);
 		markTable(&cls->methods);
+		markObject((Obj*)cls->shape);
 		break;
 	}
 	case OBJ_BOUND_METHOD: {
@@ -150,17 +484,27 @@ void blackenObject(Obj* object) {
 	}
 	case OBJ_INSTANCE: {
 		ObjInstance* instance = (ObjInstance*)object;
-		markObject((Obj*)instance->cls);
-		markTable(&instance->fields);
+		markObject((Obj*)instance->shape);
+		for (int i = 0; i < instance->shape->count; i++) {
+			markValue(*instanceSlot(instance, i));
+		}
 		break;
 	}
 	case OBJ_ARRAY: {
 		ObjArray* array = (ObjArray*)object;
 		for (int i = 0; i < array->count; i++) {
-			markValue(array->values[i]);
+			markValue(arrayValues(array)[i]);
 		}
 		break;
 	}
+	case OBJ_SHAPE: {
+		ObjShape* shape = (ObjShape*)object;
+		markObject((Obj*)shape->cls);
+		markObject((Obj*)shape->parent);
+		markObject((Obj*)shape->name);
+		markTable(&shape->transitions);
+		break;
+	}
 	}
 }
 
@@ -170,86 +514,756 @@ void markArray(ValueArray* array) {
 	}
 }
 
-void sweep() {
-	Obj* previous = NULL;
-	Obj* object = vm.objects;
-	while (object) {
-		if (object->isMarked) {
-			object->isMarked = false;
-			previous = object;
-			object = object->next;
+void markCaches(Chunk* chunk) {
+	for (int i = 0; i < chunk->cacheCount; i++) {
+		InlineCache* cache = &chunk->caches[i];
+		for (int j = 0; j < cache->count; j++) {
+			markObject(cache->entries[j].key);
+			markObject(cache->entries[j].target);
+		}
+	}
+}
+
+void rememberObject(Obj* object) {
+	if (isYoung(object) || object->isRemembered) {
+		return;
+	}
+	object->isRemembered = true;
+	if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+		Obj** temp = NULL;
+		vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+		temp = realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+		if (temp) {
+			vm.remembered = temp;
+			temp = NULL;
+		}
+		else {
+			// Forgetting the object would leave its young referents to be freed.
+			outOfMemory();
+		}
+	}
+	vm.remembered[vm.rememberedCount++] = object;
+}
+
+// What the mutator overwrites while marking is kept until the next step, as
+// the gray stack may belong to the marker thread.
+void logOverwritten(Obj* object) {
+	if (!object || isYoung(object) || isMarked(object)) {
+		return;
+	}
+	if (vm.overwrittenCapacity < vm.overwrittenCount + 1) {
+		Obj** temp = NULL;
+		vm.overwrittenCapacity = GROW_CAPACITY(vm.overwrittenCapacity);
+		temp = realloc(vm.overwritten, sizeof(Obj*) * vm.overwrittenCapacity);
+		if (temp) {
+			vm.overwritten = temp;
+			temp = NULL;
 		}
 		else {
-			Obj* unreached = object;
-			object = object->next;
-			if (previous) {
-				previous->next = object;
+			// Marking would miss what the object was reachable from.
+			outOfMemory();
+		}
+	}
+	vm.overwritten[vm.overwrittenCount++] = object;
+}
+
+void markOverwritten() {
+	for (int i = 0; i < vm.overwrittenCount; i++) {
+		markObject(vm.overwritten[i]);
+	}
+	vm.overwrittenCount = 0;
+}
+
+// Old objects about to be swept need no longer be remembered.
+void forgetWhite() {
+	int count = 0;
+	for (int i = 0; i < vm.rememberedCount; i++) {
+		if (isMarked(vm.remembered[i])) {
+			vm.remembered[count++] = vm.remembered[i];
+		}
+	}
+	vm.rememberedCount = count;
+}
+
+// Sweeps a page at a time, in the order of the heap. Objects that entered
+// the old generation since the sweep began were marked, and pages they
+// needed linked in last. Returns whether it is done.
+bool sweep(int work) {
+#ifdef CONCURRENT_GC
+	if (work == INT_MAX && vm.gcThreads > 1 && sweepInParallel()) {
+		vm.sweepClass = HEAP_CLASSES;
+		return true;
+	}
+#endif // CONCURRENT_GC
+	while (vm.sweepClass < HEAP_CLASSES && work > 0) {
+		Page* page = vm.sweepPage;
+		if (!page) {
+			if (++vm.sweepClass < HEAP_CLASSES) {
+				vm.sweepPage = vm.heap[vm.sweepClass].first;
 			}
-			else {
-				vm.objects = object;
+			continue;
+		}
+		vm.sweepPage = page->next;
+		work -= sweepPage(page, true);
+		if (page->freeCount == page->cellCount) {
+			freePage(page);
+		}
+	}
+	return vm.sweepClass == HEAP_CLASSES;
+}
+
+// Frees the page's unmarked objects, found a bitmap word at a time, the last
+// first so that its free list is left in address order. Dead strings leave
+// the intern table only as they are swept, so that no pause need walk all of
+// it, unless it has been pruned already. Returns how many objects the page
+// held.
+int sweepPage(Page* page, bool interned) {
+	int count = 0;
+	for (int i = BITMAP_WORDS - 1; i >= 0; i--) {
+		uint64_t allocated = page->allocated[i];
+		if (!allocated) {
+			continue;
+		}
+		count += bitCount(allocated);
+		uint64_t dead = allocated & (vm.markBit ? ~page->marks[i] : page->marks[i]);
+		while (dead) {
+			int bit = highestBit(dead);
+			dead &= ~((uint64_t)1 << bit);
+			Obj* object = granuleAt(page, i * 64 + bit);
+			if (object->type == OBJ_STRING && interned) {
+				tableDelete(&vm.strings, (ObjString*)object);
 			}
-			freeObject(unreached);
+			freeObject(object);
 		}
 	}
+	return count;
 }
 
-void freeObjects() {
-	Obj* object = vm.objects;
-	while (object) {
-		Obj* next = object->next;
-		freeObject(object);
-		object = next;
+// Moves the young objects reachable from the roots and from remembered old
+// objects into the old generation. Survivors are copied as they are found
+// and scanned in turn, so only live young objects are touched, then the
+// nursery is emptied. Young objects may be held in C locals wherever an
+// allocation can happen, so this only runs at run()'s safe points.
+void collectNursery() {
+#ifdef DEBUG_LOG_GC
+	printf("-- minor gc begin\n");
+	size_t before = vm.bytesAllocated;
+#endif // DEBUG_LOG_GC
+	promoteRoots();
+	for (int i = 0; i < vm.rememberedCount; i++) {
+		Obj* object = vm.remembered[i];
+		object->isRemembered = false;
+		promoteReferences(object);
 	}
-	free(vm.grayStack);
+	vm.rememberedCount = 0;
+	while (promotedCount) {
+		promoteReferences(promoted[--promotedCount]);
+	}
+	releaseNursery();
+	size_t allocated = vm.nurseryTop - vm.nursery;
+	vm.nurseryTop = vm.nursery;
+#ifdef DEBUG_LOG_GC
+	printf("-- minor gc end\n");
+	printf("   promote %ld bytes\n", vm.bytesAllocated - before);
+#endif // DEBUG_LOG_GC
+	// Young objects pay for collections too, or one could stall while the old
+	// generation stays the same size.
+	if (vm.gcPhase != GC_IDLE) {
+		collect(vm.gcStepWork * (int)(allocated / GC_STEP_SIZE));
+	}
+	if (vm.heapLimit && vm.bytesAllocated > vm.heapLimit) {
+		enforceLimit(0);
+	}
+	if (vm.bytesAllocated > vm.nextGC) {
+		collectStep();
+	}
+#ifdef CONCURRENT_GC
+	if (vm.gcPhase == GC_MARK && vm.concurrentGC && !vm.markerActive) {
+		startMarker();
+	}
+#endif // CONCURRENT_GC
 }
 
-void freeObject(Obj* object) {
-	switch (object->type) {
-	case OBJ_STRING: {
-		ObjString* string = (ObjString*)object;
-		FREE_ARRAY(char, string->data, string->length + 1);
-		FREE(ObjString, object);
-		break;
+// The compiler is never partway through a function at a safe point, so has
+// no roots of its own.
+void promoteRoots() {
+	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+		*slot = promoteValue(*slot);
 	}
-	case OBJ_UPVALUE:
-		FREE(ObjUpvalue, object);
-		break;
+	for (int i = 0; i < vm.frameCount; i++) {
+		vm.frames[i].closure = (ObjClosure*)promote((Obj*)vm.frames[i].closure);
+	}
+	for (ObjUpvalue** upvalue = &vm.openUpvalues; *upvalue; upvalue = &(*upvalue)->next) {
+		*upvalue = (ObjUpvalue*)promote((Obj*)*upvalue);
+	}
+	promoteTable(&vm.globalSlots);
+	for (int i = 0; i < vm.globals.count; i++) {
+		vm.globals.values[i] = promoteValue(vm.globals.values[i]);
+	}
+	vm.initString = (ObjString*)promote((Obj*)vm.initString);
+}
+
+// Returns where a young object now lives. The copy is given a cell directly,
+// as a major collection must not step partway through a minor one. Like objects
+// allocated old it is marked, and not traced: whatever it pointed to when
+// marking began was marked with the nursery.
+Obj* promote(Obj* object) {
+	if (!isYoung(object)) {
+		return object;
+	}
+	if (object->isForwarded) {
+		return FORWARD(object);
+	}
+	size_t size = objectSize(object);
+	Obj* copy = allocateCell(size);
+	memcpy(copy, object, size);
+	vm.bytesAllocated += size;
+	if (vm.gcPhase != GC_IDLE) {
+		bytesDuring += size;
+	}
+	if (object->type == OBJ_UPVALUE) {
+		ObjUpvalue* upvalue = (ObjUpvalue*)object;
+		if (upvalue->location == &upvalue->closed) {
+			((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+		}
+	}
+#ifdef DEBUG_LOG_GC
+	printf("%p promote to %p\n", (void*)object, (void*)copy);
+#endif // DEBUG_LOG_GC
+	setMarked(copy);
+	if (promotedCapacity < promotedCount + 1) {
+		Obj** temp = NULL;
+		promotedCapacity = GROW_CAPACITY(promotedCapacity);
+		temp = realloc(promoted, sizeof(Obj*) * promotedCapacity);
+		if (temp) {
+			promoted = temp;
+			temp = NULL;
+		}
+		else {
+			// The copy would never be scanned, and what it refers to freed.
+			outOfMemory();
+		}
+	}
+	promoted[promotedCount++] = copy;
+	object->isForwarded = true;
+	FORWARD(object) = copy;
+	return copy;
+}
+
+Value promoteValue(Value value) {
+	if (!IS_OBJ(value)) {
+		return value;
+	}
+	return OBJ_VAL(promote(AS_OBJ(value)));
+}
+
+void promoteReferences(Obj* object) {
+	switch (object->type) {
+	case OBJ_STRING:
 	case OBJ_NATIVE:
-		FREE(ObjNative, object);
 		break;
+	case OBJ_UPVALUE: {
+		ObjUpvalue* upvalue = (ObjUpvalue*)object;
+		upvalue->closed = promoteValue(upvalue->closed);
+		break;
+	}
 	case OBJ_FUNCTION: {
 		ObjFunction* function = (ObjFunction*)object;
-		freeChunk(&function->chunk);
-		FREE(ObjFunction, object);
+		function->name = (ObjString*)promote((Obj*)function->name);
+		function->source = (ObjString*)promote((Obj*)function->source);
+		for (int i = 0; i < function->chunk.constants.count; i++) {
+			function->chunk.constants.values[i] = promoteValue(function->chunk.constants.values[i]);
+		}
+		for (int i = 0; i < function->chunk.cacheCount; i++) {
+			InlineCache* cache = &function->chunk.caches[i];
+			for (int j = 0; j < cache->count; j++) {
+				cache->entries[j].key = promote(cache->entries[j].key);
+				cache->entries[j].target = promote(cache->entries[j].target);
+			}
+		}
 		break;
 	}
 	case OBJ_CLOSURE: {
 		ObjClosure* closure = (ObjClosure*)object;
-		FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-		FREE(ObjClosure, object);
+		closure->function = (ObjFunction*)promote((Obj*)closure->function);
+		for (int i = 0; i < closure->upvalueCount; i++) {
+			closure->upvalues[i] = (ObjUpvalue*)promote((Obj*)closure->upvalues[i]);
+		}
 		break;
 	}
 	case OBJ_CLASS: {
 		ObjClass* cls = (ObjClass*)object;
-		freeTable(&cls->methods);
-		FREE(ObjClass, object);
+		cls->name = (ObjString*)promote((Obj*)cls->name);
+		promoteTable(&cls->methods);
+		cls->shape = (ObjShape*)promote((Obj*)cls->shape);
 		break;
 	}
+	case OBJ_BOUND_METHOD: {
+		ObjBoundMethod* bound = (ObjBoundMethod*)object;
+		bound->receiver = promoteValue(bound->receiver);
+		bound->method = (ObjClosure*)promote((Obj*)bound->method);
+		break;
+	}
+	case OBJ_INSTANCE: {
+		ObjInstance* instance = (ObjInstance*)object;
+		instance->shape = (ObjShape*)promote((Obj*)instance->shape);
+		for (int i = 0; i < instance->shape->count; i++) {
+			Value* slot = instanceSlot(instance, i);
+			*slot = promoteValue(*slot);
+		}
+		break;
+	}
+	case OBJ_ARRAY: {
+		ObjArray* array = (ObjArray*)object;
+		for (int i = 0; i < array->count; i++) {
+			arrayValues(array)[i] = promoteValue(arrayValues(array)[i]);
+		}
+		break;
+	}
+	case OBJ_SHAPE: {
+		ObjShape* shape = (ObjShape*)object;
+		shape->cls = (ObjClass*)promote((Obj*)shape->cls);
+		shape->parent = (ObjShape*)promote((Obj*)shape->parent);
+		shape->name = (ObjString*)promote((Obj*)shape->name);
+		promoteTable(&shape->transitions);
+		break;
+	}
+	}
+}
+
+// A moved key keeps its hash, and so its entry.
+void promoteTable(Table* table) {
+	for (int i = 0; i < table->capacity; i++) {
+		Entry* entry = &table->entries[i];
+		if (entry->key) {
+			entry->key = (ObjString*)promote((Obj*)entry->key);
+			entry->value = promoteValue(entry->value);
+		}
+	}
+}
+
+// Frees what the young objects left behind own, and follows or drops the
+// interned strings among them, which the string table holds weakly. Only a
+// promoted object's copy is whole.
+void releaseNursery() {
+	uint8_t* cell = vm.nursery;
+	while (cell < vm.nurseryTop) {
+		Obj* object = (Obj*)cell;
+		if (object->isForwarded) {
+			Obj* copy = FORWARD(object);
+			if (copy->type == OBJ_STRING) {
+				tableMoveKey(&vm.strings, (ObjString*)object, (ObjString*)copy);
+			}
+			cell += ALIGN(objectSize(copy));
+			continue;
+		}
+		if (object->type == OBJ_STRING) {
+			tableDelete(&vm.strings, (ObjString*)object);
+		}
+		cell += ALIGN(objectSize(object));
+		releaseObject(object);
+	}
+}
+
+size_t objectSize(Obj* object) {
+	switch (object->type) {
+	case OBJ_STRING:
+		return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+	case OBJ_UPVALUE:
+		return sizeof(ObjUpvalue);
+	case OBJ_NATIVE:
+		return sizeof(ObjNative);
+	case OBJ_FUNCTION:
+		return sizeof(ObjFunction);
+	case OBJ_CLOSURE:
+		return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalueCount;
+	case OBJ_CLASS:
+		return sizeof(ObjClass);
 	case OBJ_BOUND_METHOD:
-		FREE(ObjBoundMethod, object);
+		return sizeof(ObjBoundMethod);
+	case OBJ_INSTANCE:
+		return sizeof(ObjInstance);
+	case OBJ_ARRAY:
+		return sizeof(ObjArray);
+	case OBJ_SHAPE:
+		return sizeof(ObjShape);
+	}
+	return 0; // TODO need internal error logic
+}
+
+void freeObjects() {
+#ifdef CONCURRENT_GC
+	stopMarker();
+	stopWorkers();
+#endif // CONCURRENT_GC
+	for (uint8_t* cell = vm.nursery; cell < vm.nurseryTop; cell += ALIGN(objectSize((Obj*)cell))) {
+		releaseObject((Obj*)cell);
+	}
+	for (Obj* object = firstObject(); object; object = nextObject(object)) {
+		releaseObject(object);
+	}
+	freeHeap();
+	free(vm.nursery);
+	free(promoted);
+	promoted = NULL;
+	promotedCount = promotedCapacity = 0;
+	free(vm.remembered);
+	free(vm.grayStack);
+	free(vm.overwritten);
+}
+
+void freeObject(Obj* object) {
+	size_t size = objectSize(object);
+	releaseObject(object);
+	freeCell(object);
+#ifdef CONCURRENT_GC
+	if (self) {
+		self->freed += size;
+		return;
+	}
+#endif // CONCURRENT_GC
+	vm.bytesAllocated -= size;
+}
+
+// Frees what an object owns, but not the object itself.
+void releaseObject(Obj* object) {
+	switch (object->type) {
+	case OBJ_FUNCTION:
+		freeChunk(&((ObjFunction*)object)->chunk);
+		break;
+	case OBJ_CLASS:
+		freeTable(&((ObjClass*)object)->methods);
 		break;
 	case OBJ_INSTANCE: {
 		ObjInstance* instance = (ObjInstance*)object;
-		freeTable(&instance->fields);
-		FREE(ObjInstance, object);
+		FREE_ARRAY(Value, instance->fields, instance->capacity);
 		break;
 	}
 	case OBJ_ARRAY: {
 		ObjArray* array = (ObjArray*)object;
-		FREE_ARRAY(Value, array->values, array->capacity);
+		if (array->capacity > ARRAY_INLINE_VALUES) {
+			FREE_ARRAY(Value, array->values, array->capacity);
+		}
 		break;
 	}
+	case OBJ_SHAPE:
+		freeTable(&((ObjShape*)object)->transitions);
+		break;
 	default:
-		break; // TODO need internal error logic
+		break;
+	}
+}
+
+// The mutator takes the heap from the marker thread only while it runs.
+void acquireHeap() {
+#ifdef CONCURRENT_GC
+	if (pthread_mutex_trylock(&heapMutex)) {
+		atomic_store(&mutatorWaiting, true);
+		pthread_mutex_lock(&heapMutex);
+		atomic_store(&mutatorWaiting, false);
+	}
+#endif // CONCURRENT_GC
+}
+
+void releaseHeap() {
+#ifdef CONCURRENT_GC
+	pthread_mutex_unlock(&heapMutex);
+#endif // CONCURRENT_GC
+}
+
+#ifdef CONCURRENT_GC
+// Only called from a minor collection, so at a safe point, where no object
+// the marker could reach is half built. With one processor the marker would
+// only take turns with the mutator, so marking carries on in steps, as it
+// does if the thread cannot be had.
+void startMarker() {
+	if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+		vm.concurrentGC = false;
+		return;
+	}
+	if (!markerStarted) {
+		markerStarted = !pthread_create(&marker, NULL, markConcurrently, NULL);
+		if (!markerStarted) {
+			return;
+		}
+	}
+	acquireHeap();
+	markOverwritten();
+	marking = true;
+	vm.markerActive = true;
+	pthread_cond_signal(&markerWake);
+	releaseHeap();
+}
+
+// Gives the marker what has been overwritten since the last step. Returns
+// whether marking is back with the mutator, as the marker is out of objects
+// or is to stop so that the collection can be finished at once.
+bool handOff(bool stop) {
+	acquireHeap();
+	markOverwritten();
+	bool done = stop || !vm.grayCount;
+	if (done) {
+		marking = false;
+		vm.markerActive = false;
+	}
+	else {
+		pthread_cond_signal(&markerWake);
+	}
+	releaseHeap();
+	return done;
+}
+
+void stopMarker() {
+	if (!markerStarted) {
+		return;
+	}
+	acquireHeap();
+	marking = false;
+	markerExit = true;
+	vm.markerActive = false;
+	pthread_cond_signal(&markerWake);
+	releaseHeap();
+	pthread_join(marker, NULL);
+	markerStarted = false;
+}
+
+// Traces the gray stack a batch at a time, holding the heap for each, and
+// stepping aside between them if the mutator is waiting for it.
+void* markConcurrently(void* unused) {
+	pthread_mutex_lock(&heapMutex);
+	while (!markerExit) {
+		if (!marking || !vm.grayCount) {
+			pthread_cond_wait(&markerWake, &heapMutex);
+			continue;
+		}
+		traceReferences(MARKER_BATCH);
+		if (atomic_load(&mutatorWaiting)) {
+			pthread_mutex_unlock(&heapMutex);
+			while (atomic_load(&mutatorWaiting)) {
+				sched_yield();
+			}
+			pthread_mutex_lock(&heapMutex);
+		}
+	}
+	pthread_mutex_unlock(&heapMutex);
+	return NULL;
+}
+#endif // CONCURRENT_GC
+
+#ifdef CONCURRENT_GC
+// Marks from the roots already gray, which the first worker shares out.
+void traceInParallel() {
+	startWorkers();
+	Worker* first = &workers[0];
+	Obj** stack = first->shared;
+	int capacity = first->sharedCapacity;
+	first->shared = vm.grayStack;
+	first->sharedCount = vm.grayCount;
+	first->sharedCapacity = vm.grayCapacity;
+	vm.grayStack = stack;
+	vm.grayCount = 0;
+	vm.grayCapacity = capacity;
+	atomic_store(&idleWorkers, 0);
+	runInParallel(markShared);
+}
+
+// Dead strings leave the intern table first, a slice for each worker, as
+// it cannot be changed while the pages are being swept. Only the mutator
+// unlinks the pages emptied. Returns false, having swept nothing, if the
+// pages cannot be shared out.
+bool sweepInParallel() {
+	startWorkers();
+	sweepPageCount = 0;
+	for (int i = 0; i < HEAP_CLASSES; i++) {
+		for (Page* page = vm.heap[i].first; page; page = page->next) {
+			if (sweepPageCapacity < sweepPageCount + 1) {
+				int capacity = GROW_CAPACITY(sweepPageCapacity);
+				Page** temp = realloc(sweepPages, sizeof(Page*) * capacity);
+				if (!temp) {
+					return false;
+				}
+				sweepPages = temp;
+				sweepPageCapacity = capacity;
+			}
+			sweepPages[sweepPageCount++] = page;
+		}
+	}
+	atomic_store(&nextPage, 0);
+	runInParallel(pruneStrings);
+	runInParallel(sweepShared);
+	for (int i = 0; i < workerCount; i++) {
+		vm.bytesAllocated -= workers[i].freed;
+		workers[i].freed = 0;
+	}
+	for (int i = 0; i < sweepPageCount; i++) {
+		if (sweepPages[i]->freeCount == sweepPages[i]->cellCount) {
+			freePage(sweepPages[i]);
+		}
+	}
+	return true;
+}
+
+// The mutator does its share of the task, then waits for the others.
+void runInParallel(Task next) {
+	pthread_mutex_lock(&poolMutex);
+	task = next;
+	taskGeneration++;
+	tasksRunning = workerCount - 1;
+	pthread_cond_broadcast(&poolWake);
+	pthread_mutex_unlock(&poolMutex);
+	self = &workers[0];
+	next(self);
+	self = NULL;
+	pthread_mutex_lock(&poolMutex);
+	while (tasksRunning) {
+		pthread_cond_wait(&poolDone, &poolMutex);
+	}
+	pthread_mutex_unlock(&poolMutex);
+}
+
+// Threads are started the first time they are needed. If one cannot be
+// had, the work is shared among those that could.
+void startWorkers() {
+	while (workerCount < vm.gcThreads) {
+		Worker* worker = &workers[workerCount];
+		worker->count = worker->capacity = 0;
+		worker->stack = NULL;
+		worker->sharedCount = worker->sharedCapacity = 0;
+		worker->shared = NULL;
+		worker->freed = 0;
+		worker->generation = taskGeneration;
+		pthread_mutex_init(&worker->lock, NULL);
+		if (workerCount && pthread_create(&worker->thread, NULL, runWorker, worker)) {
+			pthread_mutex_destroy(&worker->lock);
+			break;
+		}
+		workerCount++;
+	}
+}
+
+void stopWorkers() {
+	pthread_mutex_lock(&poolMutex);
+	poolExit = true;
+	pthread_cond_broadcast(&poolWake);
+	pthread_mutex_unlock(&poolMutex);
+	for (int i = 0; i < workerCount; i++) {
+		if (i) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		free(workers[i].stack);
+		free(workers[i].shared);
+		pthread_mutex_destroy(&workers[i].lock);
+	}
+	workerCount = 0;
+	poolExit = false;
+	free(sweepPages);
+	sweepPages = NULL;
+	sweepPageCount = sweepPageCapacity = 0;
+}
+
+void* runWorker(void* argument) {
+	self = argument;
+	pthread_mutex_lock(&poolMutex);
+	while (true) {
+		while (self->generation == taskGeneration && !poolExit) {
+			pthread_cond_wait(&poolWake, &poolMutex);
+		}
+		if (poolExit) {
+			break;
+		}
+		self->generation = taskGeneration;
+		Task current = task;
+		pthread_mutex_unlock(&poolMutex);
+		current(self);
+		pthread_mutex_lock(&poolMutex);
+		if (!--tasksRunning) {
+			pthread_cond_signal(&poolDone);
+		}
+	}
+	pthread_mutex_unlock(&poolMutex);
+	return NULL;
+}
+
+// A worker out of objects counts itself idle, and stops once all of them
+// are, as then none has any left to share.
+void markShared(Worker* worker) {
+	while (true) {
+		while (worker->count || takeGray(worker, worker)) {
+			blackenObject(worker->stack[--worker->count]);
+			if (worker->count > SHARE_THRESHOLD && atomic_load(&idleWorkers)) {
+				shareGray(worker);
+			}
+		}
+		atomic_fetch_add(&idleWorkers, 1);
+		while (!stealGray(worker)) {
+			if (atomic_load(&idleWorkers) == workerCount) {
+				return;
+			}
+			sched_yield();
+		}
+	}
+}
+
+// Shares the bottom half of the worker's stack, which is nearest the roots
+// and so likely leads to the most.
+void shareGray(Worker* worker) {
+	pthread_mutex_lock(&worker->lock);
+	if (!worker->sharedCount) {
+		int count = worker->count / 2;
+		if (worker->sharedCapacity < count) {
+			Obj** temp = realloc(worker->shared, sizeof(Obj*) * count);
+			if (!temp) {
+				pthread_mutex_unlock(&worker->lock);
+				return;
+			}
+			worker->shared = temp;
+			worker->sharedCapacity = count;
+		}
+		memcpy(worker->shared, worker->stack, sizeof(Obj*) * count);
+		memmove(worker->stack, worker->stack + count, sizeof(Obj*) * (worker->count - count));
+		worker->sharedCount = count;
+		worker->count -= count;
+	}
+	pthread_mutex_unlock(&worker->lock);
+}
+
+// The thief is not idle while it looks, so that no other worker stops while
+// it may yet find work.
+bool stealGray(Worker* thief) {
+	atomic_fetch_sub(&idleWorkers, 1);
+	int index = (int)(thief - workers);
+	for (int i = 0; i < workerCount; i++) {
+		if (takeGray(thief, &workers[(index + i) % workerCount])) {
+			return true;
+		}
+	}
+	atomic_fetch_add(&idleWorkers, 1);
+	return false;
+}
+
+// Takes half of what another worker, or the worker itself, has shared.
+bool takeGray(Worker* worker, Worker* from) {
+	pthread_mutex_lock(&from->lock);
+	int count = (from->sharedCount + 1) / 2;
+	for (int i = 0; i < count; i++) {
+		pushGray(from->shared[--from->sharedCount]);
+	}
+	pthread_mutex_unlock(&from->lock);
+	return count > 0;
+}
+
+void pruneStrings(Worker* worker) {
+	int index = (int)(worker - workers);
+	int from = (int)((long long)vm.strings.capacity * index / workerCount);
+	int to = (int)((long long)vm.strings.capacity * (index + 1) / workerCount);
+	tableRemoveWhite(&vm.strings, from, to);
+}
+
+// Workers take pages in turn until none are left.
+void sweepShared(Worker* worker) {
+	int index;
+	while ((index = atomic_fetch_add(&nextPage, 1)) < sweepPageCount) {
+		sweepPage(sweepPages[index], false);
 	}
 }
+#endif // CONCURRENT_GC
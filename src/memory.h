@@ -1,8 +1,14 @@
 #pragma once
 
 #include "object.h"
+#include "vm.h"
 
 #define DEFAULT_CAPACITY 8
+#define NURSERY_SIZE 0x40000
+#define GC_MIN_HEAP 0x100000 // No collection begins before the old generation is this large.
+// Left free past the point a minor collection is due, for what is allocated
+// before run() reaches a safe point.
+#define NURSERY_RESERVE 0x8000
 
 #define ALLOCATE(type, count) \
 	(type*)reallocate(NULL, 0, sizeof(type) * (count));
@@ -20,7 +26,78 @@
 	reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 void* reallocate(void*, size_t, size_t);
+Obj* allocateYoung(size_t);
+Obj* allocateOld(size_t);
+void outOfMemory();
 void collectGarbage();
+void collectNursery();
 void markValue(Value);
 void markObject(Obj*);
+void rememberObject(Obj*);
+void logOverwritten(Obj*);
+void acquireHeap();
+void releaseHeap();
 void freeObjects();
+
+static inline bool isYoung(Obj* object) {
+	return (uintptr_t)object - (uintptr_t)vm.nursery < NURSERY_SIZE;
+}
+
+// Old objects' marks are kept in their pages' bitmaps, so that marking writes
+// to none of them. What counts as marked flips with each collection. The
+// bitmaps may be shared with the marker thread, or with other workers.
+static inline bool isMarked(Obj* object) {
+	int granule = granuleOf(object);
+	uint64_t* word = &pageOf(object)->marks[granule / 64];
+#ifdef CONCURRENT_GC
+	uint64_t marks = __atomic_load_n(word, __ATOMIC_RELAXED);
+#else
+	uint64_t marks = *word;
+#endif // CONCURRENT_GC
+	return (marks >> (granule % 64) & 1) == vm.markBit;
+}
+
+// Returns whether it was marked already.
+static inline bool setMarked(Obj* object) {
+	int granule = granuleOf(object);
+	uint64_t* word = &pageOf(object)->marks[granule / 64];
+	uint64_t bit = (uint64_t)1 << (granule % 64);
+#ifdef CONCURRENT_GC
+	uint64_t marks = vm.markBit ? __atomic_fetch_or(word, bit, __ATOMIC_RELAXED) : __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+#else
+	uint64_t marks = *word;
+	*word = vm.markBit ? marks | bit : marks & ~bit;
+#endif // CONCURRENT_GC
+	return ((marks & bit) != 0) == vm.markBit;
+}
+
+// Stores of young references into old objects are remembered, so that minor
+// collections need not trace the old generation to find them.
+static inline void writeBarrier(Obj* object, Value value) {
+	if (IS_OBJ(value) && isYoung(AS_OBJ(value)) && !object->isRemembered) {
+		rememberObject(object);
+	}
+}
+
+// Marking finds what was reachable when it began. A reference about to be
+// overwritten is logged, as the marker may not yet have seen it, and the
+// mutator may have put it somewhere the marker has.
+static inline void snapshotBarrier(Value old) {
+	if (vm.gcPhase == GC_MARK && IS_OBJ(old)) {
+		logOverwritten(AS_OBJ(old));
+	}
+}
+
+// Brackets changes a marker thread could see half made: growing an array,
+// table or cache, or giving an instance a field. No collection steps inside.
+static inline void lockHeap() {
+	if (!vm.heapLocks++ && vm.markerActive) {
+		acquireHeap();
+	}
+}
+
+static inline void unlockHeap() {
+	if (!--vm.heapLocks && vm.markerActive) {
+		releaseHeap();
+	}
+}
@@ -42,6 +42,11 @@ Value gc(int argCount, Value* args) {
 	return NIL_VAL;
 }
 
+// The longest step of the last collection, in seconds.
+Value maxPause(int argCount, Value* args) {
+	return NUMBER_VAL(vm.maxPause);
+}
+
 Value printStack(int argCount, Value* args) {
 	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
 		printf("[ ");
@@ -53,7 +58,14 @@ Value printStack(int argCount, Value* args) {
 }
 
 Value printGlobals(int argCount, Value* args) {
-	printTable(&vm.globals, true);
+	printf("[");
+	for (int i = 0; i < vm.globals.count; i++) {
+		if (!IS_UNDEFINED(vm.globals.values[i])) {
+			printf("%s%s: ", i ? ", " : "", globalName(i)->data);
+			printValue(vm.globals.values[i]);
+		}
+	}
+	printf("]\n");
 	return NIL_VAL;
 }
 
@@ -61,3 +73,31 @@ Value printStrings(int argCount, Value* args) {
 	printTable(&vm.strings, false);
 	return NIL_VAL;
 }
+
+Value cacheHits(int argCount, Value* args) {
+	return NUMBER_VAL(vm.cacheHits);
+}
+
+Value cacheMisses(int argCount, Value* args) {
+	return NUMBER_VAL(vm.cacheMisses);
+}
+
+// In the order they are defined. Snapshots refer to a native by its index.
+const NativeDef natives[] = {
+	{ "clock", clockNative },
+	{ "scan", scanNative },
+	{ "sin", sinNative },
+#ifdef DEBUG_DIAG_TOOLS
+	{ "bytes_allocated", bytesAllocated },
+	{ "next_gc", nextGC },
+	{ "gc", gc },
+	{ "max_pause", maxPause },
+	{ "print_stack", printStack },
+	{ "print_globals", printGlobals },
+	{ "print_strings", printStrings },
+	{ "cache_hits", cacheHits },
+	{ "cache_misses", cacheMisses },
+#endif // DEBUG_DIAG_TOOLS
+};
+
+const int nativeCount = sizeof(natives) / sizeof(NativeDef);
@@ -3,14 +3,26 @@
 #include <string.h>
 
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 
+typedef struct {
+	const char* name;
+	NativeFn function;
+} NativeDef;
+
 Value clockNative(int, Value*);
 Value scanNative(int, Value*);
 Value sinNative(int, Value*);
 Value bytesAllocated(int, Value*);
 Value nextGC(int, Value*);
 Value gc(int, Value*);
+Value maxPause(int, Value*);
 Value printStack(int, Value*);
 Value printGlobals(int, Value*);
 Value printStrings(int, Value*);
+Value cacheHits(int, Value*);
+Value cacheMisses(int, Value*);
+
+extern const NativeDef natives[];
+extern const int nativeCount;
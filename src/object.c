@@ -18,15 +18,15 @@ static char* printType(ObjType);
 static void printFunction(ObjFunction*);
 static void printArray(ObjArray*);
 static uint32_t hashString(const char*, int);
-static ObjString* allocateString(char*, int, uint32_t);
+static ObjString* findInterned(const char*, int, uint32_t);
 static ObjString* functionToString(ObjFunction*);
 
 Obj* allocateObject(size_t size, ObjType type) {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);
+	Obj* object = allocateYoung(size);
+	if (!object) {
+		object = allocateOld(size);
+	}
 	object->type = type;
-	object->isMarked = false;
-	object->next = vm.objects;
-	vm.objects = object;
 #ifdef DEBUG_LOG_GC
 	printf("%p allocate %ld bytes for %s\n", (void*)object, size, printType(type));
 #endif // DEBUG_LOG_GC
@@ -53,6 +53,8 @@ char* printType(ObjType type) {
 		return "instance";
 	case OBJ_ARRAY:
 		return "array";
+	case OBJ_SHAPE:
+		return "shape";
 	default:
 		return "unknown object";
 	}
@@ -79,12 +81,15 @@ void printObject(Value value) {
 		printFunction(AS_BOUND_METHOD(value)->method->function);
 		break;
 	case OBJ_INSTANCE:
-		printf("%s instance", AS_INSTANCE(value)->cls->name->data);
+		printf("%s instance", AS_INSTANCE(value)->shape->cls->name->data);
 		break;
 	case OBJ_ARRAY: {
 		printArray(AS_ARRAY(value));
 		break;
 	}
+	case OBJ_SHAPE:
+		printf("<shape %d>", AS_SHAPE(value)->count);
+		break;
 	default:
 		break; // TODO need internal error logic
 	}
@@ -101,13 +106,13 @@ void printFunction(ObjFunction* function) {
 void printArray(ObjArray* array) {
 	printf("{");
 	if (array->count > 5) {
-		printValue(array->values[0]);
+		printValue(arrayValues(array)[0]);
 		printf(", ... , ");
-		printValue(array->values[array->count - 1]);
+		printValue(arrayValues(array)[array->count - 1]);
 	}
 	else {
 		for (int i = 0; i < array->count; i++) {
-			printValue(array->values[i]);
+			printValue(arrayValues(array)[i]);
 			if (i < array->count - 1) {
 				printf(", ");
 			}
@@ -116,26 +121,60 @@ void printArray(ObjArray* array) {
 	printf("}");
 }
 
+// A string unreachable when marking began, or not yet swept, may be found
+// while it is dead, and is revived.
+ObjString* findInterned(const char* string, int length, uint32_t hash) {
+	ObjString* interned = tableFindString(&vm.strings, string, length, hash);
+	if (interned && vm.gcPhase != GC_IDLE && !isYoung((Obj*)interned)) {
+		setMarked((Obj*)interned);
+	}
+	return interned;
+}
+
+// Interned strings are looked for before one is allocated.
 ObjString* copyString(const char* string, int length) {
 	uint32_t hash = hashString(string, length);
-	ObjString* interned = tableFindString(&vm.strings, string, length, hash);
+	ObjString* interned = findInterned(string, length, hash);
 	if (interned) {
 		return interned;
 	}
-	char* data = ALLOCATE(char, length + 1);
-	memcpy(data, string, length);
-	data[length] = '\0';
-	return allocateString(data, length, hash);
+	ObjString* copy = newString(length);
+	memcpy(copy->data, string, length);
+	copy->hash = hash;
+	push(OBJ_VAL(copy));
+	tableSet(&vm.strings, copy, NIL_VAL);
+	pop();
+	return copy;
 }
 
+// For strings built in buffers of their own, which are freed.
 ObjString* takeString(char* string, int length) {
-	uint32_t hash = hashString(string, length);
-	ObjString* interned = tableFindString(&vm.strings, string, length, hash);
+	ObjString* taken = copyString(string, length);
+	FREE_ARRAY(char, string, length + 1);
+	return taken;
+}
+
+// The characters follow in the same allocation. They are to be filled in,
+// then the string interned.
+ObjString* newString(int length) {
+	ObjString* string = (ObjString*)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
+	string->length = length;
+	string->hash = 0;
+	string->data[length] = '\0';
+	return string;
+}
+
+// Returns the string interned with the same characters, which may be another.
+ObjString* internString(ObjString* string) {
+	string->hash = hashString(string->data, string->length);
+	ObjString* interned = findInterned(string->data, string->length, string->hash);
 	if (interned) {
-		FREE_ARRAY(char, string, length + 1);
 		return interned;
 	}
-	return allocateString(string, length, hash);
+	push(OBJ_VAL(string));
+	tableSet(&vm.strings, string, NIL_VAL);
+	pop();
+	return string;
 }
 
 uint32_t hashString(const char* key, int length) {
@@ -147,17 +186,6 @@ uint32_t hashString(const char* key, int length) {
 	return hash;
 }
 
-ObjString* allocateString(char* data, int length, uint32_t hash) {
-	ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-	string->length = length;
-	string->data = data;
-	string->hash = hash;
-	push(OBJ_VAL(string));
-	tableSet(&vm.strings, string, NIL_VAL);
-	pop();
-	return string;
-}
-
 ObjString* objectToString(Value value) {
 	ObjString* string = NULL;
 	switch (OBJ_TYPE(value)) {
@@ -165,7 +193,7 @@ ObjString* objectToString(Value value) {
 		string = AS_STRING(value);
 		break;
 	case OBJ_NATIVE:
-		string = takeString("<native fn>", 11);
+		string = copyString("<native fn>", 11);
 		break;
 	case OBJ_FUNCTION:
 	case OBJ_CLOSURE:
@@ -187,13 +215,12 @@ ObjString* objectToString(Value value) {
 		string = AS_CLASS(value)->name;
 		break;
 	case OBJ_INSTANCE: {
-		ObjInstance* instance = AS_INSTANCE(value);
-		int length = instance->cls->name->length + 9;
-		char* data = ALLOCATE(char, length + 1);
-		memcpy(data, instance->cls->name->data, length - 9);
-		memcpy(data + length - 9, " instance", 9);
-		data[length] = '\0';
-		string = takeString(data, length);
+		ObjClass* cls = AS_INSTANCE(value)->shape->cls;
+		ObjString* name = cls->name;
+		string = newString(name->length + 9);
+		memcpy(string->data, name->data, name->length);
+		memcpy(string->data + name->length, " instance", 9);
+		string = internString(string);
 		break;
 	}
 	case OBJ_ARRAY: {
@@ -203,7 +230,7 @@ ObjString* objectToString(Value value) {
 		ObjString* rep = NULL;
 		memcpy(data, "{", len);
 		for (int i = 0; i < array->count; i++) {
-			rep = valueToString(array->values[i]);
+			rep = valueToString(arrayValues(array)[i]);
 			while (size < len + rep->length + 2) {
 				int old = size;
 				size = GROW_CAPACITY(old);
@@ -234,16 +261,15 @@ ObjString* objectToString(Value value) {
 ObjString* functionToString(ObjFunction* function) {
 	ObjString* string = NULL;
 	if (!function->name) {
-		string = takeString("<script>", 8);
+		string = copyString("<script>", 8);
 	}
 	else {
-		int length = function->name->length + 5;
-		char* data = ALLOCATE(char, length + 1);
-		memcpy(data, "<fn ", 4);
-		memcpy(data + 4, function->name->data, length - 1);
-		memcpy(data + length - 1, ">", 1);
-		data[length] = '\0';
-		string = takeString(data, length);
+		ObjString* name = function->name;
+		string = newString(name->length + 5);
+		memcpy(string->data, "<fn ", 4);
+		memcpy(string->data + 4, name->data, name->length);
+		memcpy(string->data + 4 + name->length, ">", 1);
+		string = internString(string);
 	}
 	return string;
 }
@@ -266,20 +292,24 @@ ObjFunction* newFunction() {
 	ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 	function->arity = 0;
 	function->upvalueCount = 0;
+	function->slotCount = 0;
 	function->name = NULL;
+	function->source = NULL;
+	function->line = 0;
+	function->context = 0;
 	initChunk(&function->chunk);
 	return function;
 }
 
+// The upvalues follow in the same allocation.
 ObjClosure* newClosure(ObjFunction* function) {
-	ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-	for (int i = 0; i < function->upvalueCount; i++) {
-		upvalues[i] = NULL;
-	}
-	ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+	size_t size = sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalueCount;
+	ObjClosure* closure = (ObjClosure*)allocateObject(size, OBJ_CLOSURE);
 	closure->function = function;
-	closure->upvalues = upvalues;
 	closure->upvalueCount = function->upvalueCount;
+	for (int i = 0; i < closure->upvalueCount; i++) {
+		closure->upvalues[i] = NULL;
+	}
 	return closure;
 }
 
@@ -287,6 +317,10 @@ ObjClass* newClass(ObjString* name) {
 	ObjClass* cls = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
 	cls->name = name;
 	initTable(&cls->methods);
+	cls->shape = NULL;
+	push(OBJ_VAL(cls));
+	cls->shape = newShape(cls, NULL, NULL);
+	pop();
 	return cls;
 }
 
@@ -299,15 +333,70 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
 
 ObjInstance* newInstance(ObjClass* cls) {
 	ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
-	instance->cls = cls;
-	initTable(&instance->fields);
+	instance->shape = cls->shape;
+	instance->capacity = 0;
+	instance->fields = NULL;
 	return instance;
 }
 
 ObjArray* newArray() {
 	ObjArray* array = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
 	array->count = 0;
-	array->capacity = 0;
-	array->values = NULL;
+	array->capacity = ARRAY_INLINE_VALUES;
 	return array;
 }
+
+// Makes room for at least the given count of elements.
+void growArray(ObjArray* array, int count) {
+	if (array->capacity >= count) {
+		return;
+	}
+	int oldCapacity = array->capacity;
+	int capacity = oldCapacity;
+	while (capacity < count) {
+		capacity = GROW_CAPACITY(capacity);
+	}
+	Value* values = NULL;
+	if (oldCapacity > ARRAY_INLINE_VALUES) {
+		values = GROW_ARRAY(array->values, Value, oldCapacity, capacity);
+	}
+	else {
+		values = ALLOCATE(Value, capacity);
+		memcpy(values, array->inlineValues, sizeof(Value) * array->count);
+	}
+	array->values = values;
+	array->capacity = capacity;
+}
+
+ObjShape* newShape(ObjClass* cls, ObjShape* parent, ObjString* name) {
+	ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+	shape->cls = cls;
+	shape->parent = parent;
+	shape->name = name;
+	shape->count = parent ? parent->count + 1 : 0;
+	initTable(&shape->transitions);
+	return shape;
+}
+
+int shapeSlot(ObjShape* shape, ObjString* name) {
+	for (; shape->parent; shape = shape->parent) {
+		if (shape->name == name) {
+			return shape->count - 1;
+		}
+	}
+	return -1;
+}
+
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+	Value next;
+	if (tableGet(&shape->transitions, name, &next)) {
+		return AS_SHAPE(next);
+	}
+	ObjShape* child = newShape(shape->cls, shape, name);
+	push(OBJ_VAL(child));
+	tableSet(&shape->transitions, name, OBJ_VAL(child));
+	writeBarrier((Obj*)shape, OBJ_VAL(name));
+	writeBarrier((Obj*)shape, OBJ_VAL(child));
+	pop();
+	return child;
+}
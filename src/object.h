@@ -14,6 +14,7 @@
 #define IS_BOUND_METHOD(value)  isObjType(value, OBJ_BOUND_METHOD)
 #define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
 #define IS_ARRAY(value)         isObjType(value, OBJ_ARRAY)
+#define IS_SHAPE(value)         isObjType(value, OBJ_SHAPE)
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))        
 #define AS_CSTRING(value)       (AS_STRING(value)->data)
 #define AS_NATIVE(value)        (((ObjNative*)AS_OBJ(value))->function)
@@ -23,6 +24,10 @@
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_INSTANCE(value)      ((ObjInstance*)AS_OBJ(value))
 #define AS_ARRAY(value)         ((ObjArray*)AS_OBJ(value))
+#define AS_SHAPE(value)         ((ObjShape*)AS_OBJ(value))
+
+#define INSTANCE_INLINE_FIELDS 4
+#define ARRAY_INLINE_VALUES 4
 
 typedef enum {
 	OBJ_STRING,
@@ -33,20 +38,23 @@ typedef enum {
 	OBJ_CLASS,
 	OBJ_BOUND_METHOD,
 	OBJ_INSTANCE,
-	OBJ_ARRAY
+	OBJ_ARRAY,
+	OBJ_SHAPE
 } ObjType;
 
+// Fields of four bytes or fewer fit in the padding after the header, so
+// objects pay at most a word for it.
 struct sObj {
-	ObjType type;
-	bool isMarked;
-	struct sObj* next;
+	uint8_t type; // An ObjType.
+	bool isRemembered;
+	bool isForwarded; // Whether a young object has been promoted, and its body holds where to.
 };
 
 struct sObjString { // TODO take 'const' strings from source
 	Obj obj;
 	int length;
-	char* data; // TODO implement as flexible array member
 	uint32_t hash;
+	char data[];
 };
 
 typedef struct sObjUpvalue {
@@ -67,22 +75,39 @@ typedef struct {
 	Obj obj;
 	int arity;
 	int upvalueCount;
+	int slotCount; // Most values its frame holds at once, the callee included.
 	Chunk chunk;
 	ObjString* name;
+	ObjString* source; // Parameters and body, while compiling them is deferred.
+	int line;
+	uint8_t context; // What compileBody() needs of where it was declared.
 } ObjFunction;
 
 typedef struct {
 	Obj obj;
-	ObjFunction* function;
-	ObjUpvalue** upvalues;
 	int upvalueCount;
+	ObjFunction* function;
+	ObjUpvalue* upvalues[];
 } ObjClosure;
 
-typedef struct sObjClass {
+// The layout shared by instances that gained the same fields in the same
+// order. Each shape adds one field to its parent, so a field's slot is the
+// count of the shape that introduced it less one.
+typedef struct sObjShape {
+	Obj obj;
+	ObjClass* cls;
+	struct sObjShape* parent;
+	ObjString* name;
+	int count;
+	Table transitions;
+} ObjShape;
+
+struct sObjClass {
 	Obj obj;
 	ObjString* name;
 	Table methods;
-} ObjClass;
+	ObjShape* shape;
+};
 
 typedef struct {
 	Obj obj;
@@ -92,20 +117,29 @@ typedef struct {
 
 typedef struct {
 	Obj obj;
-	ObjClass* cls;
-	Table fields;
+	ObjShape* shape;
+	int capacity;
+	Value* fields; // Slots past the inline ones.
+	Value inlineFields[INSTANCE_INLINE_FIELDS];
 } ObjInstance;
 
+// Small arrays keep their elements inline. Those that outgrow them move them
+// all to an allocation of their own.
 typedef struct {
 	Obj obj;
 	int count;
 	int capacity;
-	Value* values;
+	union {
+		Value* values;
+		Value inlineValues[ARRAY_INLINE_VALUES];
+	};
 } ObjArray;
 
 void printObject(Value);
 ObjString* copyString(const char*, int);
 ObjString* takeString(char*, int);
+ObjString* newString(int);
+ObjString* internString(ObjString*);
 ObjString* objectToString(Value);
 ObjUpvalue* newUpvalue(Value*);
 ObjNative* newNative(NativeFn);
@@ -115,7 +149,22 @@ ObjClass* newClass(ObjString*);
 ObjBoundMethod* newBoundMethod(Value, ObjClosure*);
 ObjInstance* newInstance(ObjClass*);
 ObjArray* newArray();
+void growArray(ObjArray*, int);
+ObjShape* newShape(ObjClass*, ObjShape*, ObjString*);
+int shapeSlot(ObjShape*, ObjString*);
+ObjShape* shapeTransition(ObjShape*, ObjString*);
 
 static inline bool isObjType(Value value, ObjType type) {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
+
+static inline Value* arrayValues(ObjArray* array) {
+	return array->capacity > ARRAY_INLINE_VALUES ? array->values : array->inlineValues;
+}
+
+static inline Value* instanceSlot(ObjInstance* instance, int slot) {
+	if (slot < INSTANCE_INLINE_FIELDS) {
+		return &instance->inlineFields[slot];
+	}
+	return &instance->fields[slot - INSTANCE_INLINE_FIELDS];
+}
@@ -4,6 +4,8 @@
 #include "common.h"
 #include "scanner.h"
 
+Scanner scanner;
+
 static void skipWhitespace();
 static bool isAtEnd();
 static Token makeToken(TokenType);
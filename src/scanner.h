@@ -41,7 +41,7 @@ typedef struct {
 	int line;
 } Scanner;
 
-Scanner scanner;
+extern Scanner scanner;
 
 void initScanner(const char*);
 Token scanToken();
@@ -0,0 +1,547 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "memory.h"
+#include "natives.h"
+#include "snapshot.h"
+#include "vm.h"
+
+#define MAGIC_LENGTH 4
+#define WRITE "wb"
+
+// A snapshot is every object live once a script has run, then the globals.
+// Objects are numbered in order of type, so that each can be created from
+// those before it (a closure from its function, a class from its name). They
+// are written twice: first what creates them, then, once all exist, what
+// they refer to. A reference is an object's number plus one, zero being
+// none, and is relocated to wherever the object is rebuilt.
+
+typedef enum {
+	SNAPSHOT_NIL,
+	SNAPSHOT_FALSE,
+	SNAPSHOT_TRUE,
+	SNAPSHOT_UNDEFINED,
+	SNAPSHOT_NUMBER,
+	SNAPSHOT_OBJECT
+} ValueTag;
+
+typedef struct {
+	Obj** objects; // Sorted by type, then address.
+	int count;
+} Heap;
+
+static int compareObjects(const void*, const void*);
+static uint32_t objectRef(Heap*, Obj*);
+static void writeValue(FILE*, Heap*, Value);
+static void writeTable(FILE*, Heap*, Table*);
+static void writeShell(FILE*, Heap*, Obj*);
+static void writeFields(FILE*, Heap*, Obj*);
+static bool writeGlobals(FILE*, Heap*);
+static Obj* readShell(Reader*, ObjArray*);
+static void readFields(Reader*, ObjArray*, Obj*);
+static void readGlobals(Reader*, ObjArray*);
+static Obj* readRef(Reader*, ObjArray*);
+static Obj* readObject(Reader*, ObjArray*, ObjType);
+static Obj* readRequired(Reader*, ObjArray*, ObjType);
+static Value readValue(Reader*, ObjArray*);
+static void readTable(Reader*, ObjArray*, Table*);
+
+// Collects first, so that everything left is old and reachable from the
+// globals.
+bool writeSnapshot(const char* path) {
+	collectNursery();
+	collectGarbage();
+	Heap heap;
+	heap.count = 0;
+	for (Obj* object = firstObject(); object; object = nextObject(object)) {
+		heap.count++;
+	}
+	heap.objects = malloc(sizeof(Obj*) * (heap.count ? heap.count : 1));
+	if (!heap.objects) {
+		return false;
+	}
+	int i = 0;
+	for (Obj* object = firstObject(); object; object = nextObject(object)) {
+		heap.objects[i++] = object;
+	}
+	qsort(heap.objects, heap.count, sizeof(Obj*), compareObjects);
+	FILE* file = fopen(path, WRITE);
+	if (!file) {
+		free(heap.objects);
+		return false;
+	}
+	fwrite(SNAPSHOT_MAGIC, 1, MAGIC_LENGTH, file);
+	writeU32(file, SNAPSHOT_VERSION);
+	writeU32(file, OP_COUNT);
+	writeU32(file, nativeCount);
+	writeU32(file, heap.count);
+	for (i = 0; i < heap.count; i++) {
+		writeShell(file, &heap, heap.objects[i]);
+	}
+	for (i = 0; i < heap.count; i++) {
+		writeFields(file, &heap, heap.objects[i]);
+	}
+	bool written = writeGlobals(file, &heap);
+	free(heap.objects);
+	written = written && !ferror(file);
+	return !fclose(file) && written;
+}
+
+int compareObjects(const void* a, const void* b) {
+	Obj* left = *(Obj**)a;
+	Obj* right = *(Obj**)b;
+	if (left->type != right->type) {
+		return left->type < right->type ? -1 : 1;
+	}
+	if (left != right) {
+		return (uintptr_t)left < (uintptr_t)right ? -1 : 1;
+	}
+	return 0;
+}
+
+uint32_t objectRef(Heap* heap, Obj* object) {
+	if (!object) {
+		return 0;
+	}
+	Obj** found = bsearch(&object, heap->objects, heap->count, sizeof(Obj*), compareObjects);
+	return (uint32_t)(found - heap->objects) + 1;
+}
+
+void writeValue(FILE* file, Heap* heap, Value value) {
+	if (IS_UNDEFINED(value)) {
+		writeU8(file, SNAPSHOT_UNDEFINED);
+	}
+	else if (IS_NIL(value)) {
+		writeU8(file, SNAPSHOT_NIL);
+	}
+	else if (IS_BOOL(value)) {
+		writeU8(file, AS_BOOL(value) ? SNAPSHOT_TRUE : SNAPSHOT_FALSE);
+	}
+	else if (IS_NUMBER(value)) {
+		double number = AS_NUMBER(value);
+		uint64_t bits;
+		memcpy(&bits, &number, sizeof(bits));
+		writeU8(file, SNAPSHOT_NUMBER);
+		writeU64(file, bits);
+	}
+	else {
+		writeU8(file, SNAPSHOT_OBJECT);
+		writeU32(file, objectRef(heap, AS_OBJ(value)));
+	}
+}
+
+void writeTable(FILE* file, Heap* heap, Table* table) {
+	int count = 0;
+	for (int i = 0; i < table->capacity; i++) {
+		count += table->entries[i].key != NULL;
+	}
+	writeU32(file, count);
+	for (int i = 0; i < table->capacity; i++) {
+		Entry* entry = &table->entries[i];
+		if (entry->key) {
+			writeU32(file, objectRef(heap, (Obj*)entry->key));
+			writeValue(file, heap, entry->value);
+		}
+	}
+}
+
+// What an object is created from.
+void writeShell(FILE* file, Heap* heap, Obj* object) {
+	writeU8(file, object->type);
+	switch (object->type) {
+	case OBJ_STRING:
+		writeString(file, (ObjString*)object);
+		break;
+	case OBJ_NATIVE: {
+		int index = 0;
+		while (index < nativeCount && natives[index].function != ((ObjNative*)object)->function) {
+			index++;
+		}
+		writeU32(file, index);
+		break;
+	}
+	case OBJ_FUNCTION: {
+		ObjFunction* function = (ObjFunction*)object;
+		writeU32(file, function->arity);
+		writeU32(file, function->upvalueCount);
+		writeU32(file, function->slotCount);
+		writeU32(file, function->line);
+		writeU8(file, function->context);
+		writeCode(file, &function->chunk);
+		break;
+	}
+	case OBJ_CLOSURE:
+		writeU32(file, objectRef(heap, (Obj*)((ObjClosure*)object)->function));
+		break;
+	case OBJ_CLASS:
+		writeU32(file, objectRef(heap, (Obj*)((ObjClass*)object)->name));
+		break;
+	case OBJ_INSTANCE:
+		writeU32(file, objectRef(heap, (Obj*)((ObjInstance*)object)->shape->cls));
+		break;
+	default:
+		break;
+	}
+}
+
+// What an object refers to.
+void writeFields(FILE* file, Heap* heap, Obj* object) {
+	switch (object->type) {
+	case OBJ_UPVALUE:
+		writeValue(file, heap, *((ObjUpvalue*)object)->location);
+		break;
+	case OBJ_FUNCTION: {
+		ObjFunction* function = (ObjFunction*)object;
+		writeU32(file, objectRef(heap, (Obj*)function->name));
+		writeU32(file, objectRef(heap, (Obj*)function->source));
+		writeU32(file, function->chunk.constants.count);
+		for (int i = 0; i < function->chunk.constants.count; i++) {
+			writeValue(file, heap, function->chunk.constants.values[i]);
+		}
+		break;
+	}
+	case OBJ_CLOSURE: {
+		ObjClosure* closure = (ObjClosure*)object;
+		for (int i = 0; i < closure->upvalueCount; i++) {
+			writeU32(file, objectRef(heap, (Obj*)closure->upvalues[i]));
+		}
+		break;
+	}
+	case OBJ_CLASS: {
+		ObjClass* cls = (ObjClass*)object;
+		writeTable(file, heap, &cls->methods);
+		writeU32(file, objectRef(heap, (Obj*)cls->shape));
+		break;
+	}
+	case OBJ_BOUND_METHOD: {
+		ObjBoundMethod* bound = (ObjBoundMethod*)object;
+		writeValue(file, heap, bound->receiver);
+		writeU32(file, objectRef(heap, (Obj*)bound->method));
+		break;
+	}
+	case OBJ_INSTANCE: {
+		ObjInstance* instance = (ObjInstance*)object;
+		writeU32(file, objectRef(heap, (Obj*)instance->shape));
+		writeU32(file, instance->shape->count);
+		for (int i = 0; i < instance->shape->count; i++) {
+			writeValue(file, heap, *instanceSlot(instance, i));
+		}
+		break;
+	}
+	case OBJ_ARRAY: {
+		ObjArray* array = (ObjArray*)object;
+		writeU32(file, array->count);
+		for (int i = 0; i < array->count; i++) {
+			writeValue(file, heap, arrayValues(array)[i]);
+		}
+		break;
+	}
+	case OBJ_SHAPE: {
+		ObjShape* shape = (ObjShape*)object;
+		writeU32(file, objectRef(heap, (Obj*)shape->cls));
+		writeU32(file, objectRef(heap, (Obj*)shape->parent));
+		writeU32(file, objectRef(heap, (Obj*)shape->name));
+		writeU32(file, shape->count);
+		writeTable(file, heap, &shape->transitions);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+// In slot order, so that naming them again hands out the same slots.
+bool writeGlobals(FILE* file, Heap* heap) {
+	int count = vm.globals.count;
+	ObjString** names = malloc(sizeof(ObjString*) * (count ? count : 1));
+	if (!names) {
+		return false;
+	}
+	for (int i = 0; i < vm.globalSlots.capacity; i++) {
+		Entry* entry = &vm.globalSlots.entries[i];
+		if (entry->key) {
+			names[(int)AS_NUMBER(entry->value)] = entry->key;
+		}
+	}
+	writeU32(file, count);
+	for (int i = 0; i < count; i++) {
+		writeU32(file, objectRef(heap, (Obj*)names[i]));
+		writeValue(file, heap, vm.globals.values[i]);
+	}
+	free(names);
+	return true;
+}
+
+// Must be read into a VM that has run nothing yet. Objects are rebuilt on
+// the heap, but code is run out of the mapping as with bytecode files.
+bool readSnapshot(const char* path) {
+	size_t size;
+	uint8_t* data = mapFile(path, &size);
+	if (!data) {
+		fprintf(stderr, "Could not open file \"%s\".\n", path);
+		return false;
+	}
+	Reader reader;
+	reader.current = data + MAGIC_LENGTH;
+	reader.end = data + size;
+	reader.failed = false;
+	reader.globals = NULL;
+	reader.globalCount = 0;
+	reader.outOfGlobals = false;
+	if (size < MAGIC_LENGTH || memcmp(data, SNAPSHOT_MAGIC, MAGIC_LENGTH)) {
+		fprintf(stderr, "\"%s\" is not a valid snapshot.\n", path);
+		return false;
+	}
+	if (readU32(&reader) != SNAPSHOT_VERSION || readU32(&reader) != OP_COUNT || readU32(&reader) != (uint32_t)nativeCount) {
+		fprintf(stderr, "\"%s\" was taken by a different version of lox.\n", path);
+		return false;
+	}
+	uint32_t count = readU32(&reader);
+	if (fits(&reader, count)) { // Every object takes at least its type.
+		// Holds each object as it is rebuilt, keeping it from being collected.
+		ObjArray* objects = newArray();
+		push(OBJ_VAL(objects));
+		growArray(objects, (int)count);
+		for (uint32_t i = 0; i < count && !reader.failed; i++) {
+			Obj* object = readShell(&reader, objects);
+			if (object) {
+				arrayValues(objects)[objects->count++] = OBJ_VAL(object);
+			}
+		}
+		for (int i = 0; i < objects->count && !reader.failed; i++) {
+			readFields(&reader, objects, AS_OBJ(arrayValues(objects)[i]));
+		}
+		readGlobals(&reader, objects);
+		pop();
+	}
+	if (reader.failed || reader.current != reader.end) {
+		fprintf(stderr, "\"%s\" is not a valid snapshot.\n", path);
+		return false;
+	}
+	return true;
+}
+
+Obj* readShell(Reader* reader, ObjArray* objects) {
+	switch (readU8(reader)) {
+	case OBJ_STRING:
+		return (Obj*)readString(reader);
+	case OBJ_UPVALUE: {
+		ObjUpvalue* upvalue = newUpvalue(NULL);
+		upvalue->location = &upvalue->closed;
+		return (Obj*)upvalue;
+	}
+	case OBJ_NATIVE: {
+		uint32_t index = readU32(reader);
+		if (index >= (uint32_t)nativeCount) {
+			reader->failed = true;
+			return NULL;
+		}
+		return (Obj*)newNative(natives[index].function);
+	}
+	case OBJ_FUNCTION: {
+		ObjFunction* function = newFunction();
+		push(OBJ_VAL(function));
+		function->arity = (int)readU32(reader);
+		function->upvalueCount = (int)readU32(reader);
+		function->slotCount = (int)readU32(reader);
+		function->line = (int)readU32(reader);
+		function->context = readU8(reader);
+		readCode(reader, &function->chunk);
+		pop();
+		return (Obj*)function;
+	}
+	case OBJ_CLOSURE: {
+		ObjFunction* function = (ObjFunction*)readRequired(reader, objects, OBJ_FUNCTION);
+		return function ? (Obj*)newClosure(function) : NULL;
+	}
+	case OBJ_CLASS: {
+		ObjString* name = (ObjString*)readRequired(reader, objects, OBJ_STRING);
+		return name ? (Obj*)newClass(name) : NULL;
+	}
+	case OBJ_BOUND_METHOD:
+		return (Obj*)newBoundMethod(NIL_VAL, NULL);
+	case OBJ_INSTANCE: {
+		ObjClass* cls = (ObjClass*)readRequired(reader, objects, OBJ_CLASS);
+		return cls ? (Obj*)newInstance(cls) : NULL;
+	}
+	case OBJ_ARRAY:
+		return (Obj*)newArray();
+	case OBJ_SHAPE:
+		return (Obj*)newShape(NULL, NULL, NULL);
+	default:
+		reader->failed = true;
+		return NULL;
+	}
+}
+
+// Fields are only pointed at other objects once anything they need is
+// allocated, as a collection may trace them at any allocation.
+void readFields(Reader* reader, ObjArray* objects, Obj* object) {
+	switch (object->type) {
+	case OBJ_UPVALUE:
+		((ObjUpvalue*)object)->closed = readValue(reader, objects);
+		break;
+	case OBJ_FUNCTION: {
+		ObjFunction* function = (ObjFunction*)object;
+		function->name = (ObjString*)readObject(reader, objects, OBJ_STRING);
+		function->source = (ObjString*)readObject(reader, objects, OBJ_STRING);
+		uint32_t count = readU32(reader);
+		for (uint32_t i = 0; i < count && fits(reader, 1); i++) {
+			addConstant(&function->chunk, readValue(reader, objects));
+		}
+		break;
+	}
+	case OBJ_CLOSURE: {
+		ObjClosure* closure = (ObjClosure*)object;
+		for (int i = 0; i < closure->upvalueCount; i++) {
+			closure->upvalues[i] = (ObjUpvalue*)readRequired(reader, objects, OBJ_UPVALUE);
+		}
+		break;
+	}
+	case OBJ_CLASS: {
+		ObjClass* cls = (ObjClass*)object;
+		readTable(reader, objects, &cls->methods);
+		ObjShape* shape = (ObjShape*)readRequired(reader, objects, OBJ_SHAPE);
+		if (shape) {
+			cls->shape = shape;
+		}
+		break;
+	}
+	case OBJ_BOUND_METHOD: {
+		ObjBoundMethod* bound = (ObjBoundMethod*)object;
+		bound->receiver = readValue(reader, objects);
+		bound->method = (ObjClosure*)readRequired(reader, objects, OBJ_CLOSURE);
+		break;
+	}
+	case OBJ_INSTANCE: {
+		ObjInstance* instance = (ObjInstance*)object;
+		ObjShape* shape = (ObjShape*)readRequired(reader, objects, OBJ_SHAPE);
+		// Shapes come after instances, so the count is not known from it yet.
+		int count = (int)readU32(reader);
+		if (!shape || !fits(reader, count)) {
+			break;
+		}
+		if (count > INSTANCE_INLINE_FIELDS) {
+			int capacity = count - INSTANCE_INLINE_FIELDS;
+			instance->fields = ALLOCATE(Value, capacity);
+			instance->capacity = capacity;
+		}
+		for (int i = 0; i < count; i++) {
+			*instanceSlot(instance, i) = readValue(reader, objects);
+		}
+		instance->shape = shape;
+		break;
+	}
+	case OBJ_ARRAY: {
+		ObjArray* array = (ObjArray*)object;
+		uint32_t count = readU32(reader);
+		if (!fits(reader, count)) {
+			break;
+		}
+		growArray(array, (int)count);
+		for (uint32_t i = 0; i < count; i++) {
+			arrayValues(array)[i] = readValue(reader, objects);
+		}
+		array->count = (int)count;
+		break;
+	}
+	case OBJ_SHAPE: {
+		ObjShape* shape = (ObjShape*)object;
+		shape->cls = (ObjClass*)readObject(reader, objects, OBJ_CLASS);
+		shape->parent = (ObjShape*)readObject(reader, objects, OBJ_SHAPE);
+		shape->name = (ObjString*)readObject(reader, objects, OBJ_STRING);
+		shape->count = (int)readU32(reader);
+		readTable(reader, objects, &shape->transitions);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+// The VM has only defined its natives, which the snapshot's globals begin
+// with, so each name is given back the slot its code refers to it by.
+void readGlobals(Reader* reader, ObjArray* objects) {
+	uint32_t count = readU32(reader);
+	for (uint32_t i = 0; i < count && !reader->failed; i++) {
+		ObjString* name = (ObjString*)readRequired(reader, objects, OBJ_STRING);
+		Value value = readValue(reader, objects);
+		if (reader->failed) {
+			break;
+		}
+		if (globalSlot(name) != (int)i) {
+			reader->failed = true;
+			break;
+		}
+		vm.globals.values[i] = value;
+	}
+}
+
+Obj* readRef(Reader* reader, ObjArray* objects) {
+	uint32_t ref = readU32(reader);
+	if (ref > (uint32_t)objects->count) {
+		reader->failed = true;
+		return NULL;
+	}
+	return ref ? AS_OBJ(arrayValues(objects)[ref - 1]) : NULL;
+}
+
+Obj* readObject(Reader* reader, ObjArray* objects, ObjType type) {
+	Obj* object = readRef(reader, objects);
+	if (object && object->type != type) {
+		reader->failed = true;
+		return NULL;
+	}
+	return object;
+}
+
+Obj* readRequired(Reader* reader, ObjArray* objects, ObjType type) {
+	Obj* object = readObject(reader, objects, type);
+	if (!object) {
+		reader->failed = true;
+	}
+	return object;
+}
+
+Value readValue(Reader* reader, ObjArray* objects) {
+	switch (readU8(reader)) {
+	case SNAPSHOT_NIL:
+		return NIL_VAL;
+	case SNAPSHOT_FALSE:
+		return BOOL_VAL(false);
+	case SNAPSHOT_TRUE:
+		return BOOL_VAL(true);
+	case SNAPSHOT_UNDEFINED:
+		return UNDEFINED_VAL;
+	case SNAPSHOT_NUMBER: {
+		uint64_t bits = readU64(reader);
+		double number;
+		memcpy(&number, &bits, sizeof(number));
+		return NUMBER_VAL(number);
+	}
+	case SNAPSHOT_OBJECT: {
+		Obj* object = readRef(reader, objects);
+		if (object) {
+			return OBJ_VAL(object);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+	reader->failed = true;
+	return NIL_VAL;
+}
+
+void readTable(Reader* reader, ObjArray* objects, Table* table) {
+	uint32_t count = readU32(reader);
+	for (uint32_t i = 0; i < count && !reader->failed; i++) {
+		ObjString* key = (ObjString*)readRequired(reader, objects, OBJ_STRING);
+		Value value = readValue(reader, objects);
+		if (key) {
+			tableSet(table, key, value);
+		}
+	}
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "common.h"
+
+#define SNAPSHOT_MAGIC "LOXS"
+#define SNAPSHOT_VERSION 3
+
+bool writeSnapshot(const char*);
+bool readSnapshot(const char*);
@@ -64,6 +64,18 @@ bool tableDelete(Table* table, ObjString* key) {
 	return true;
 }
 
+// Removes the old keys left unmarked from entries [from, to). Slices of a
+// table may be cleared in parallel, as no entry moves.
+void tableRemoveWhite(Table* table, int from, int to) {
+	for (int i = from; i < to; i++) {
+		Entry* entry = &table->entries[i];
+		if (entry->key && !isYoung((Obj*)entry->key) && !isMarked((Obj*)entry->key)) {
+			entry->key = NULL;
+			entry->value = BOOL_VAL(true);
+		}
+	}
+}
+
 void tableAddAll(Table* from, Table* to) {
 	for (int i = 0; i < from->capacity; i++) {
 		Entry* entry = &from->entries[i];
@@ -93,6 +105,7 @@ ObjString* tableFindString(Table* table, const char* string, int length, uint32_
 }
 
 void adjustCapacity(Table* table, int capacity) {
+	lockHeap();
 	Entry* entries = ALLOCATE(Entry, capacity);
 	for (int i = 0; i < capacity; i++) {
 		entries[i].key = NULL;
@@ -112,6 +125,7 @@ void adjustCapacity(Table* table, int capacity) {
 	FREE_ARRAY(Entry, table->entries, table->capacity);
 	table->entries = entries;
 	table->capacity = capacity;
+	unlockHeap();
 }
 
 Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
@@ -177,11 +191,24 @@ void markTable(Table* table) {
 	}
 }
 
-void tableRemoveWhite(Table* table) {
-	for (int i = 0; i < table->capacity; i++) {
-		Entry* entry = &table->entries[i];
-		if (entry->key && !entry->key->obj.isMarked) {
-			tableDelete(table, entry->key);
+// Follows a key the collector has moved. Its hash, and so its entry, are
+// unchanged.
+// The entry is found by the hash of where the key moved to, as a promoted
+// young string's own fields may have been overwritten.
+void tableMoveKey(Table* table, ObjString* from, ObjString* to) {
+	if (!table->count) {
+		return;
+	}
+	uint32_t index = to->hash & (table->capacity - 1);
+	while (true) {
+		Entry* entry = &table->entries[index];
+		if (entry->key == from) {
+			entry->key = to;
+			return;
+		}
+		if (!entry->key && IS_NIL(entry->value)) {
+			return;
 		}
+		index = (index + 1) & (table->capacity - 1);
 	}
 }
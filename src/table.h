@@ -19,8 +19,9 @@ void freeTable(Table*);
 bool tableGet(Table*, ObjString*, Value*);
 bool tableSet(Table*, ObjString*, Value);
 bool tableDelete(Table*, ObjString*);
+void tableRemoveWhite(Table*, int, int);
 void tableAddAll(Table*, Table*);
 ObjString* tableFindString(Table*, const char*, int, uint32_t);
 void printTable(Table*, bool);
 void markTable(Table*);
-void tableRemoveWhite(Table*);
+void tableMoveKey(Table*, ObjString*, ObjString*);
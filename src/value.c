@@ -1,6 +1,7 @@
 #include <float.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -8,8 +9,6 @@
 #include "ryu/ryu.h"
 #include "value.h"
 
-static bool cmpNumber(Value, Value);
-
 void initValueArray(ValueArray* array) {
 	array->capacity = 0;
 	array->count = 0;
@@ -22,12 +21,14 @@ void freeValueArray(ValueArray* array) {
 }
 
 void writeValueArray(ValueArray* array, Value value) {
+	lockHeap();
 	if (array->capacity < array->count + 1) {
 		int oldCapacity = array->capacity;
 		array->capacity = GROW_CAPACITY(oldCapacity);
 		array->values = GROW_ARRAY(array->values, Value, oldCapacity, array->capacity);
 	}
 	array->values[array->count++] = value;
+	unlockHeap();
 }
 
 bool valuesEqual(Value a, Value b) {
@@ -56,13 +57,6 @@ bool valuesEqual(Value a, Value b) {
 #endif
 }
 
-bool cmpNumber(Value a, Value b) {
-    if (isnan(AS_NUMBER(a))) {
-        return false;
-    }
-    return fabs(AS_NUMBER(a) - AS_NUMBER(b)) < DBL_EPSILON;
-}
-
 void printValue(Value value) {
     if (IS_BOOL(value)) {                       
         printf(AS_BOOL(value) ? "true" : "false");
@@ -85,14 +79,14 @@ ObjString* valueToString(Value value) {
 	ObjString* string = NULL;
     if (IS_BOOL(value)) {
         if (AS_BOOL(value)) {
-            string = takeString("true", 4);
+            string = copyString("true", 4);
         }
         else {
-            string = takeString("false", 5);
+            string = copyString("false", 5);
         }
     }
     else if (IS_NIL(value)) {
-        string = takeString("nil", 3);
+        string = copyString("nil", 3);
     }
     else if (IS_NUMBER(value)) {
         uint32_t precision = 0;
@@ -100,7 +94,8 @@ ObjString* valueToString(Value value) {
             precision = DBL_DIG; // TODO find better method to calculate precision
         }
         char* data = d2fixed(AS_NUMBER(value), precision);
-        string = takeString(data, strlen(data)); // TODO don't use strlen
+        string = copyString(data, (int)strlen(data)); // TODO don't use strlen
+        free(data); // Allocated by ryu, not the collector.
     }
     else if (IS_OBJ(value)) {
         string = objectToString(value);
@@ -117,3 +112,36 @@ bool isInteger(Value value) {
 	}
 	return false;
 }
+
+bool isFalsey(Value value) {
+    if (IS_BOOL(value)) {
+        return !AS_BOOL(value);
+    }
+    else if (IS_NIL(value)) {
+        return true;
+    }
+    else if (IS_NUMBER(value)) {
+        return !AS_NUMBER(value);
+    }
+    else if (IS_OBJ(value)) { 
+		switch (AS_OBJ(value)->type) {
+		case OBJ_STRING:
+			return !strcmp(AS_CSTRING(value), "");
+		case OBJ_NATIVE:
+		case OBJ_FUNCTION:
+		case OBJ_CLOSURE:
+		case OBJ_CLASS:
+		case OBJ_BOUND_METHOD:
+		case OBJ_INSTANCE:
+		case OBJ_SHAPE:
+			return false;
+		case OBJ_ARRAY:
+			return !AS_ARRAY(value)->count;
+		default:
+			break;
+		}
+    }
+    else {
+        return true; // TODO need internal error logic
+    }
+}
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <float.h>
+#include <math.h>
+
 #include "common.h"
 
 typedef struct sObj Obj;
 typedef struct sObjString ObjString;
+typedef struct sObjClass ObjClass;
 
 #ifdef NAN_BOXING
 
@@ -13,11 +17,13 @@ typedef struct sObjString ObjString;
 #define TAG_NIL           1
 #define TAG_FALSE         2
 #define TAG_TRUE          3
+#define TAG_UNDEFINED     4
 
 #define IS_BOOL(value)    (((value) & FALSE_VAL) == FALSE_VAL)
 #define IS_NIL(value)     ((value) == NIL_VAL)
 #define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
 #define IS_OBJ(value)     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define AS_BOOL(value)    ((value) == TRUE_VAL)
 #define AS_NUMBER(value)  valueToNum(value)
 #define AS_OBJ(value)     ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
@@ -25,6 +31,7 @@ typedef struct sObjString ObjString;
 #define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL     ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(value) numToValue(value)
 #define OBJ_VAL(object)   ((Value)(SIGN_BIT | QNAN | (uint64_t)(object)))
 
@@ -53,11 +60,13 @@ static inline Value numToValue(double num) {
 #define IS_NIL(value)     ((value).type == VAL_NIL)   
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)   
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define AS_BOOL(value)    ((value).as.boolean)                       
 #define AS_NUMBER(value)  ((value).as.number)  
 #define AS_OBJ(value)     ((value).as.obj)
 #define BOOL_VAL(value)   ((Value){ VAL_BOOL, { .boolean = value } }) 
 #define NIL_VAL           ((Value){ VAL_NIL, { .number = 0 } })       
+#define UNDEFINED_VAL     ((Value){ VAL_UNDEFINED, { .number = 0 } })
 #define NUMBER_VAL(value) ((Value){ VAL_NUMBER, { .number = value } })
 #define OBJ_VAL(object)   ((Value){ VAL_OBJ, { .obj = (Obj*)object } })
 
@@ -65,7 +74,8 @@ typedef enum {
 	VAL_BOOL,
 	VAL_NIL,
 	VAL_NUMBER,
-	VAL_OBJ
+	VAL_OBJ,
+	VAL_UNDEFINED // Marks a global slot that is named but not yet defined.
 } ValueType;
 
 typedef struct {
@@ -79,6 +89,13 @@ typedef struct {
 
 #endif
 
+static inline bool cmpNumber(Value a, Value b) {
+	if (isnan(AS_NUMBER(a))) {
+		return false;
+	}
+	return fabs(AS_NUMBER(a) - AS_NUMBER(b)) < DBL_EPSILON;
+}
+
 typedef struct {
 	int capacity;
 	int count;
@@ -89,6 +106,7 @@ void initValueArray(ValueArray*);
 void freeValueArray(ValueArray*);
 void writeValueArray(ValueArray*, Value);
 bool valuesEqual(Value, Value);
+bool isFalsey(Value);
 void printValue(Value);
 ObjString* valueToString(Value);
 bool isInteger(Value);
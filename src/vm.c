@@ -1,6 +1,8 @@
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "chunk.h"
@@ -12,35 +14,93 @@
 #include "value.h"
 #include "vm.h"
 
-#define DEFAULT_NEXT_GC 0x100000
+#define TRACE_ENDS 16
+#define DEFAULT_GC_OVERHEAD 100
+#define DEFAULT_GC_STEP_WORK 0x400
+
+VM vm;
 
 static void resetStack();
+static bool ensureStack(int);
 static void initEnv();
 static void defineNative(const char*, NativeFn);
 static InterpretResult run();
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(CallFrame*, uint8_t*);
+#endif // DEBUG_TRACE_EXECUTION
 static Value peek(int);
 static void concatenate();
-static bool isFalsey(Value);
 static ObjUpvalue* captureUpvalue(Value*);
 static void closeUpvalues(Value*);
 static void defineMethod(ObjString*);
-static bool bindMethod(ObjClass*, ObjString*);
+static void appendElements(ObjArray*, Value*, int);
+static CacheEntry* probeCache(InlineCache*, Obj*);
+static CacheEntry* fillCache(InlineCache*, Obj*, Obj*, int);
+static CacheEntry* findProperty(ObjInstance*, ObjString*, InlineCache*);
+static void setProperty(ObjInstance*, ObjString*, InlineCache*, Value);
+static void growFields(ObjInstance*, int);
+static bool findMethod(ObjClass*, ObjString*, InlineCache*, Value*);
+static void bindMethod(ObjClosure*);
 static bool callValue(Value, int);
 static bool call(ObjClosure*, int);
-static bool invoke(ObjString*, int);
-static bool invokeFromClass(ObjClass*, ObjString*, int);
+static bool invoke(ObjString*, int, InlineCache*);
+static bool invokeFromClass(ObjClass*, ObjString*, int, InlineCache*);
 static void runtimeError(const char*, ...);
 
 void initVM() {
 	vm.bytesAllocated = 0;
-	vm.nextGC = DEFAULT_NEXT_GC;
-	vm.objects = NULL;
+	vm.nextGC = GC_MIN_HEAP;
+	vm.gcOverhead = DEFAULT_GC_OVERHEAD;
+	vm.heapLimit = 0;
+	vm.survivalRatio = 1;
+	vm.allocationRate = 0;
+	vm.gcPhase = GC_IDLE;
+	vm.markBit = false;
+	vm.gcStepWork = DEFAULT_GC_STEP_WORK;
+	vm.gcPause = 0;
+	vm.maxPause = 0;
+	vm.sweepClass = 0;
+	vm.sweepPage = NULL;
+	vm.gcThreads = 1;
+	vm.concurrentGC = false;
+	vm.markerActive = false;
+	vm.heapLocks = 0;
+	initHeap();
+	vm.nursery = malloc(NURSERY_SIZE);
+	if (!vm.nursery) {
+		outOfMemory();
+	}
+	vm.nurseryTop = vm.nursery;
+#ifdef DEBUG_STRESS_GC
+	vm.nurseryLimit = vm.nursery;
+#else
+	vm.nurseryLimit = vm.nursery + NURSERY_SIZE - NURSERY_RESERVE;
+#endif // DEBUG_STRESS_GC
+	vm.rememberedCount = 0;
+	vm.rememberedCapacity = 0;
+	vm.remembered = NULL;
 	vm.grayCount = 0;
 	vm.grayCapacity = 0;
 	vm.grayStack = NULL;
+	vm.overwrittenCount = 0;
+	vm.overwrittenCapacity = 0;
+	vm.overwritten = NULL;
+	vm.cacheHits = 0;
+	vm.cacheMisses = 0;
+	vm.frames = NULL;
+	vm.frameCapacity = 0;
+	vm.framesMax = DEFAULT_FRAMES_MAX;
+	vm.lazyCompile = false;
+	vm.wideGlobals = false;
+	vm.stack = NULL;
+	vm.stackCapacity = 0;
 	resetStack();
-	initTable(&vm.globals);
+	initTable(&vm.globalSlots);
+	initValueArray(&vm.globals);
 	initTable(&vm.strings);
+	if (!ensureStack(STACK_HEADROOM)) {
+		outOfMemory();
+	}
 	initEnv();
 }
 
@@ -50,32 +110,91 @@ void resetStack() {
 	vm.openUpvalues = NULL;
 }
 
+// Moving the stack leaves frames, open upvalues and stackTop pointing into the
+// old one, so it is copied rather than reallocated and they are rebased while
+// both are live. False if there is no memory for a larger one.
+bool ensureStack(int needed) {
+	int count = (int)(vm.stackTop - vm.stack);
+	if (count + needed <= vm.stackCapacity) {
+		return true;
+	}
+	int capacity = vm.stackCapacity;
+	while (capacity < count + needed) {
+		if (capacity > INT_MAX / 2) {
+			return false;
+		}
+		capacity = GROW_CAPACITY(capacity);
+	}
+	Value* stack = ALLOCATE(Value, capacity);
+	if (!stack) {
+		return false;
+	}
+	for (int i = 0; i < count; i++) {
+		stack[i] = vm.stack[i];
+	}
+	for (int i = 0; i < vm.frameCount; i++) {
+		vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+	}
+	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue; upvalue = upvalue->next) {
+		upvalue->location = stack + (upvalue->location - vm.stack);
+	}
+	FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+	vm.stack = stack;
+	vm.stackTop = stack + count;
+	vm.stackCapacity = capacity;
+	return true;
+}
+
 void initEnv() {
 	vm.initString = copyString("init", 4); // TODO avoid magic constants
-	defineNative("clock", clockNative);
-	defineNative("scan", scanNative);
-	defineNative("sin", sinNative);
-#ifdef DEBUG_DIAG_TOOLS
-	defineNative("bytes_allocated", bytesAllocated);
-	defineNative("next_gc", nextGC);
-	defineNative("gc", gc);
-	defineNative("print_stack", printStack);
-	defineNative("print_globals", printGlobals);
-	defineNative("print_strings", printStrings);
-#endif // DEBUG_DEV_TOOLS
+	for (int i = 0; i < nativeCount; i++) {
+		defineNative(natives[i].name, natives[i].function);
+	}
 }
 
 void defineNative(const char* name, NativeFn function) {
 	push(OBJ_VAL(copyString(name, (int)strlen(name))));
 	push(OBJ_VAL(newNative(function)));
-	tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+	int slot = globalSlot(AS_STRING(vm.stack[0]));
+	vm.globals.values[slot] = vm.stack[1];
+	pop();
 	pop();
+}
+
+// Globals are resolved to slots as they are compiled, so a slot may be named
+// well before the statement defining it runs. Until then it holds
+// UNDEFINED_VAL.
+int globalSlot(ObjString* name) {
+	Value slot;
+	if (tableGet(&vm.globalSlots, name, &slot)) {
+		return (int)AS_NUMBER(slot);
+	}
+	push(OBJ_VAL(name));
+	writeValueArray(&vm.globals, UNDEFINED_VAL);
+	tableSet(&vm.globalSlots, name, NUMBER_VAL(vm.globals.count - 1));
 	pop();
+	return vm.globals.count - 1;
+}
+
+ObjString* globalName(int slot) {
+	for (int i = 0; i < vm.globalSlots.capacity; i++) {
+		Entry* entry = &vm.globalSlots.entries[i];
+		if (entry->key && AS_NUMBER(entry->value) == slot) {
+			return entry->key;
+		}
+	}
+	return NULL;
 }
 
 void freeVM() {
-	freeTable(&vm.globals);
+#ifdef DEBUG_PROFILE_OPCODES
+	printOpcodeProfile();
+#endif // DEBUG_PROFILE_OPCODES
+	freeTable(&vm.globalSlots);
+	freeValueArray(&vm.globals);
 	freeTable(&vm.strings);
+	FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
+	FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
 	freeObjects();
 	vm.initString = NULL;
 }
@@ -85,6 +204,10 @@ InterpretResult interpret(const char* source) {
 	if (!function) {
 		return INTERPRET_COMPILE_ERROR;
 	}
+	return interpretFunction(function);
+}
+
+InterpretResult interpretFunction(ObjFunction* function) {
 	push(OBJ_VAL(function));
 	ObjClosure* closure = newClosure(function);
 	pop();
@@ -94,376 +217,785 @@ InterpretResult interpret(const char* source) {
 }
 
 InterpretResult run() {
-	CallFrame* frame = &vm.frames[vm.frameCount - 1];
-	// TODO store *frame->ip in a local register variable
-#define READ_BYTE() (*frame->ip++)
+	CallFrame* frame;
+	uint8_t* ip;
+	Value* constants;
+	int operand; // Decoded by a long form before it joins the short form.
+#define LOAD_FRAME() \
+	do { \
+		frame = &vm.frames[vm.frameCount - 1]; \
+		ip = frame->ip; \
+		constants = frame->closure->function->chunk.constants.values; \
+	} while (false)
+#define STORE_FRAME() (frame->ip = ip)
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-	(frame->ip += 2, (uint16_t)((frame->ip[-2] << 8 | frame->ip[-1])))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+	(ip += 2, (uint16_t)((ip[-2] << 8 | ip[-1])))
+#define READ_LONG() \
+	(ip += 3, (int)(ip[-3] << 16 | ip[-2] << 8 | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op) \
+#define READ_STRING_LONG() AS_STRING(constants[READ_LONG()])
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define RUNTIME_ERROR(...) \
 	do { \
-	  if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-		runtimeError("Operands must be numbers."); \
+		STORE_FRAME(); \
+		runtimeError(__VA_ARGS__); \
 		return INTERPRET_RUNTIME_ERROR; \
+	} while (false)
+#define QUICKEN(op) (ip[-1] = op)
+// Puts the generic instruction back and runs it over the same operands.
+#define DEOPTIMIZE(op) \
+	do { \
+		*--ip = op; \
+		DISPATCH(); \
+	} while (false)
+#define BINARY_OP(valueType, op, quick) \
+	do { \
+	  if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+		RUNTIME_ERROR("Operands must be numbers."); \
 	  } \
+	  QUICKEN(quick); \
 	  double b = AS_NUMBER(pop()); \
 	  double a = AS_NUMBER(pop()); \
 	  push(valueType(a op b)); \
 	} while (false)
-	while (true) {
+#define COMPARE_JUMP(op) \
+	do { \
+	  uint16_t offset = READ_SHORT(); \
+	  if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+		RUNTIME_ERROR("Operands must be numbers."); \
+	  } \
+	  double b = AS_NUMBER(pop()); \
+	  double a = AS_NUMBER(pop()); \
+	  if (!(a op b)) { \
+		ip += offset; \
+	  } \
+	} while (false)
+#define NUMBER_OP(valueType, op, generic) \
+	do { \
+	  Value b = peek(0); \
+	  Value a = peek(1); \
+	  if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+		DEOPTIMIZE(generic); \
+	  } \
+	  vm.stackTop[-2] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+	  vm.stackTop--; \
+	} while (false)
+// Minor collections move young objects, so wait for instructions that hold
+// none in locals. Every loop, call and return is one.
+#define SAFE_POINT() \
+	do { \
+		if (vm.nurseryTop > vm.nurseryLimit) { \
+			collectNursery(); \
+		} \
+	} while (false)
 #ifdef DEBUG_TRACE_EXECUTION
-		printf("          ");
-		for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-			printf("[ ");
-			printValue(*slot);
-			printf(" ]");
-		}
-		printf("\n");
-		disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_EXECUTION() traceExecution(frame, ip)
+#else
+#define TRACE_EXECUTION() do { } while (false)
 #endif // DEBUG_TRACE_EXECUTION
-		uint8_t instruction;
-		switch (instruction = READ_BYTE()) {
-		case OP_CONSTANT: {
-			Value constant = READ_CONSTANT();
-			push(constant);
-			break;
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_OPCODE() profileOpcode(*ip)
+#else
+#define PROFILE_OPCODE() do { } while (false)
+#endif // DEBUG_PROFILE_OPCODES
+#ifdef COMPUTED_GOTO
+	static void* dispatchTable[] = {
+		[OP_CONSTANT] = &&L_OP_CONSTANT,
+		[OP_NIL] = &&L_OP_NIL,
+		[OP_TRUE] = &&L_OP_TRUE,
+		[OP_FALSE] = &&L_OP_FALSE,
+		[OP_POP] = &&L_OP_POP,
+		[OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+		[OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+		[OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+		[OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+		[OP_SET_GLOBAL] = &&L_OP_SET_GLOBAL,
+		[OP_GET_UPVALUE] = &&L_OP_GET_UPVALUE,
+		[OP_SET_UPVALUE] = &&L_OP_SET_UPVALUE,
+		[OP_GET_PROPERTY] = &&L_OP_GET_PROPERTY,
+		[OP_SET_PROPERTY] = &&L_OP_SET_PROPERTY,
+		[OP_GET_INDEX] = &&L_OP_GET_INDEX,
+		[OP_SET_INDEX] = &&L_OP_SET_INDEX,
+		[OP_GET_SUPER] = &&L_OP_GET_SUPER,
+		[OP_EQUAL] = &&L_OP_EQUAL,
+		[OP_NOT_EQUAL] = &&L_OP_NOT_EQUAL,
+		[OP_GREATER] = &&L_OP_GREATER,
+		[OP_GREATER_EQUAL] = &&L_OP_GREATER_EQUAL,
+		[OP_LESS] = &&L_OP_LESS,
+		[OP_LESS_EQUAL] = &&L_OP_LESS_EQUAL,
+		[OP_ADD] = &&L_OP_ADD,
+		[OP_SUBTRACT] = &&L_OP_SUBTRACT,
+		[OP_MULTIPLY] = &&L_OP_MULTIPLY,
+		[OP_DIVIDE] = &&L_OP_DIVIDE,
+		[OP_EXPONENTIATE] = &&L_OP_EXPONENTIATE,
+		[OP_NOT] = &&L_OP_NOT,
+		[OP_NEGATE] = &&L_OP_NEGATE,
+		[OP_PRINT] = &&L_OP_PRINT,
+		[OP_JUMP] = &&L_OP_JUMP,
+		[OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+		[OP_POP_JUMP_IF_FALSE] = &&L_OP_POP_JUMP_IF_FALSE,
+		[OP_EQUAL_JUMP] = &&L_OP_EQUAL_JUMP,
+		[OP_NOT_EQUAL_JUMP] = &&L_OP_NOT_EQUAL_JUMP,
+		[OP_GREATER_JUMP] = &&L_OP_GREATER_JUMP,
+		[OP_GREATER_EQUAL_JUMP] = &&L_OP_GREATER_EQUAL_JUMP,
+		[OP_LESS_JUMP] = &&L_OP_LESS_JUMP,
+		[OP_LESS_EQUAL_JUMP] = &&L_OP_LESS_EQUAL_JUMP,
+		[OP_LOOP] = &&L_OP_LOOP,
+		[OP_CALL] = &&L_OP_CALL,
+		[OP_TAIL_CALL] = &&L_OP_TAIL_CALL,
+		[OP_INVOKE] = &&L_OP_INVOKE,
+		[OP_SUPER_INVOKE] = &&L_OP_SUPER_INVOKE,
+		[OP_CLOSURE] = &&L_OP_CLOSURE,
+		[OP_CLOSE_UPVALUE] = &&L_OP_CLOSE_UPVALUE,
+		[OP_RETURN] = &&L_OP_RETURN,
+		[OP_CLASS] = &&L_OP_CLASS,
+		[OP_INHERIT] = &&L_OP_INHERIT,
+		[OP_METHOD] = &&L_OP_METHOD,
+		[OP_ARRAY] = &&L_OP_ARRAY,
+		[OP_ARRAY_APPEND] = &&L_OP_ARRAY_APPEND,
+		[OP_CONSTANT_LONG] = &&L_OP_CONSTANT_LONG,
+		[OP_GET_LOCAL_LONG] = &&L_OP_GET_LOCAL_LONG,
+		[OP_SET_LOCAL_LONG] = &&L_OP_SET_LOCAL_LONG,
+		[OP_GET_GLOBAL_LONG] = &&L_OP_GET_GLOBAL_LONG,
+		[OP_DEFINE_GLOBAL_LONG] = &&L_OP_DEFINE_GLOBAL_LONG,
+		[OP_SET_GLOBAL_LONG] = &&L_OP_SET_GLOBAL_LONG,
+		[OP_GET_UPVALUE_LONG] = &&L_OP_GET_UPVALUE_LONG,
+		[OP_SET_UPVALUE_LONG] = &&L_OP_SET_UPVALUE_LONG,
+		[OP_GET_PROPERTY_LONG] = &&L_OP_GET_PROPERTY_LONG,
+		[OP_SET_PROPERTY_LONG] = &&L_OP_SET_PROPERTY_LONG,
+		[OP_GET_SUPER_LONG] = &&L_OP_GET_SUPER_LONG,
+		[OP_CLOSURE_LONG] = &&L_OP_CLOSURE_LONG,
+		[OP_CLASS_LONG] = &&L_OP_CLASS_LONG,
+		[OP_METHOD_LONG] = &&L_OP_METHOD_LONG,
+		[OP_EQUAL_NUMBER] = &&L_OP_EQUAL_NUMBER,
+		[OP_NOT_EQUAL_NUMBER] = &&L_OP_NOT_EQUAL_NUMBER,
+		[OP_GREATER_NUMBER] = &&L_OP_GREATER_NUMBER,
+		[OP_GREATER_EQUAL_NUMBER] = &&L_OP_GREATER_EQUAL_NUMBER,
+		[OP_LESS_NUMBER] = &&L_OP_LESS_NUMBER,
+		[OP_LESS_EQUAL_NUMBER] = &&L_OP_LESS_EQUAL_NUMBER,
+		[OP_ADD_NUMBER] = &&L_OP_ADD_NUMBER,
+		[OP_SUBTRACT_NUMBER] = &&L_OP_SUBTRACT_NUMBER,
+		[OP_MULTIPLY_NUMBER] = &&L_OP_MULTIPLY_NUMBER,
+		[OP_DIVIDE_NUMBER] = &&L_OP_DIVIDE_NUMBER,
+		[OP_POPN] = &&L_OP_POPN,
+		[OP_GET_LOCAL_LOCAL] = &&L_OP_GET_LOCAL_LOCAL,
+		[OP_GET_LOCAL_CONSTANT] = &&L_OP_GET_LOCAL_CONSTANT,
+		[OP_GET_LOCAL_PROPERTY] = &&L_OP_GET_LOCAL_PROPERTY,
+		[OP_SET_LOCAL_POP] = &&L_OP_SET_LOCAL_POP,
+		[OP_SET_GLOBAL_POP] = &&L_OP_SET_GLOBAL_POP
+	};
+#define INTERPRET_LOOP DISPATCH();
+#define TARGET(op) L_##op
+#define DISPATCH() \
+	do { \
+		TRACE_EXECUTION(); \
+		PROFILE_OPCODE(); \
+		goto *dispatchTable[READ_BYTE()]; \
+	} while (false)
+#else
+#define INTERPRET_LOOP \
+	loop: \
+		TRACE_EXECUTION(); \
+		PROFILE_OPCODE(); \
+		switch (READ_BYTE())
+#define TARGET(op) case op
+#define DISPATCH() goto loop
+#endif // COMPUTED_GOTO
+	LOAD_FRAME();
+	INTERPRET_LOOP {
+	TARGET(OP_GET_LOCAL_CONSTANT):
+		push(frame->slots[READ_BYTE()]);
+		// Falls through to push the constant.
+	TARGET(OP_CONSTANT): {
+		Value constant = READ_CONSTANT();
+		push(constant);
+		DISPATCH();
+	}
+	TARGET(OP_CONSTANT_LONG):
+		push(constants[READ_LONG()]);
+		DISPATCH();
+	TARGET(OP_NIL):
+		push(NIL_VAL);
+		DISPATCH();
+	TARGET(OP_TRUE):
+		push(BOOL_VAL(true));
+		DISPATCH();
+	TARGET(OP_FALSE):
+		push(BOOL_VAL(false));
+		DISPATCH();
+	TARGET(OP_POP):
+		pop();
+		DISPATCH();
+	TARGET(OP_POPN):
+		vm.stackTop -= READ_BYTE();
+		DISPATCH();
+	TARGET(OP_GET_LOCAL_LOCAL):
+		push(frame->slots[READ_BYTE()]);
+		// Falls through to push the second local.
+	TARGET(OP_GET_LOCAL): {
+		uint8_t slot = READ_BYTE();
+		push(frame->slots[slot]);
+		DISPATCH();
+	}
+	TARGET(OP_SET_LOCAL): {
+		uint8_t slot = READ_BYTE();
+		frame->slots[slot] = peek(0);
+		DISPATCH();
+	}
+	TARGET(OP_GET_LOCAL_LONG):
+		push(frame->slots[READ_SHORT()]);
+		DISPATCH();
+	TARGET(OP_SET_LOCAL_LONG):
+		frame->slots[READ_SHORT()] = peek(0);
+		DISPATCH();
+	TARGET(OP_SET_LOCAL_POP): {
+		uint8_t slot = READ_BYTE();
+		frame->slots[slot] = pop();
+		DISPATCH();
+	}
+	TARGET(OP_GET_GLOBAL_LONG):
+		operand = READ_SHORT();
+		goto getGlobal;
+	TARGET(OP_GET_GLOBAL):
+		operand = READ_BYTE();
+	getGlobal: {
+		Value value = vm.globals.values[operand];
+		if (IS_UNDEFINED(value)) {
+			RUNTIME_ERROR("Undefined variable '%s'.", globalName(operand)->data);
 		}
-		case OP_NIL:
-			push(NIL_VAL);
-			break;
-		case OP_TRUE:
-			push(BOOL_VAL(true));
-			break;
-		case OP_FALSE:
-			push(BOOL_VAL(false));
-			break;
-		case OP_POP:
-			pop();
-			break;
-		case OP_GET_LOCAL: {
-			uint8_t slot = READ_BYTE();
-			push(frame->slots[slot]);
-			break;
+		push(value);
+		DISPATCH();
+	}
+	TARGET(OP_DEFINE_GLOBAL):
+		vm.globals.values[READ_BYTE()] = pop();
+		DISPATCH();
+	TARGET(OP_DEFINE_GLOBAL_LONG):
+		vm.globals.values[READ_SHORT()] = pop();
+		DISPATCH();
+	TARGET(OP_SET_GLOBAL_LONG):
+		operand = READ_SHORT();
+		goto setGlobal;
+	TARGET(OP_SET_GLOBAL):
+		operand = READ_BYTE();
+	setGlobal:
+		if (IS_UNDEFINED(vm.globals.values[operand])) {
+			RUNTIME_ERROR("Undefined variable '%s'", globalName(operand)->data);
 		}
-		case OP_SET_LOCAL: {
-			uint8_t slot = READ_BYTE();
-			frame->slots[slot] = peek(0);
-			break;
+		vm.globals.values[operand] = peek(0);
+		DISPATCH();
+	TARGET(OP_SET_GLOBAL_POP): {
+		uint8_t slot = READ_BYTE();
+		if (IS_UNDEFINED(vm.globals.values[slot])) {
+			RUNTIME_ERROR("Undefined variable '%s'", globalName(slot)->data);
 		}
-		case OP_GET_GLOBAL: {
-			ObjString* name = READ_STRING();
-			Value value;
-			if (!tableGet(&vm.globals, name, &value)) {
-				runtimeError("Undefined variable '%s'.", name->data);
-				return INTERPRET_RUNTIME_ERROR;
+		vm.globals.values[slot] = pop();
+		DISPATCH();
+	}
+	TARGET(OP_GET_UPVALUE): {
+		uint8_t slot = READ_BYTE();
+		push(*frame->closure->upvalues[slot]->location);
+		DISPATCH();
+	}
+	TARGET(OP_SET_UPVALUE_LONG):
+		operand = READ_SHORT();
+		goto setUpvalue;
+	TARGET(OP_SET_UPVALUE):
+		operand = READ_BYTE();
+	setUpvalue: {
+		ObjUpvalue* upvalue = frame->closure->upvalues[operand];
+		snapshotBarrier(*upvalue->location);
+		*upvalue->location = peek(0);
+		writeBarrier((Obj*)upvalue, peek(0));
+		DISPATCH();
+	}
+	TARGET(OP_GET_UPVALUE_LONG):
+		push(*frame->closure->upvalues[READ_SHORT()]->location);
+		DISPATCH();
+	TARGET(OP_GET_PROPERTY_LONG):
+		operand = READ_LONG();
+		goto getProperty;
+	TARGET(OP_GET_LOCAL_PROPERTY):
+		push(frame->slots[READ_BYTE()]);
+		// Falls through to look the property up on the local.
+	TARGET(OP_GET_PROPERTY):
+		operand = READ_BYTE();
+	getProperty: {
+		ObjString* name = AS_STRING(constants[operand]);
+		InlineCache* cache = READ_CACHE();
+		if (IS_STRING(peek(0)) || IS_ARRAY(peek(0))) {
+			if (!strcmp(name->data, "length")) {
+				Value obj = pop(); // Obj.
+				push(NUMBER_VAL(IS_STRING(obj) ? AS_STRING(obj)->length : AS_ARRAY(obj)->count));
+			}
+			else {
+				RUNTIME_ERROR("%s have no property '%s'.", IS_STRING(peek(0)) ? "Strings" : "Arrays", name->data);
 			}
+			DISPATCH();
+		}
+		if (!IS_INSTANCE(peek(0))) {
+			RUNTIME_ERROR("Only instances have properties.");
+		}
+		ObjInstance* instance = AS_INSTANCE(peek(0));
+		CacheEntry* entry = findProperty(instance, name, cache);
+		if (!entry) {
+			RUNTIME_ERROR("Undefined property '%s'.", name->data);
+		}
+		if (entry->slot >= 0) {
+			Value value = *instanceSlot(instance, entry->slot);
+			pop(); // Instance.
 			push(value);
-			break;
+			DISPATCH();
 		}
-		case OP_DEFINE_GLOBAL: {
-			ObjString* name = READ_STRING();
-			tableSet(&vm.globals, name, peek(0));
-			pop();
-			break;
+		bindMethod((ObjClosure*)entry->target);
+		DISPATCH();
+	}
+	TARGET(OP_SET_PROPERTY_LONG):
+		operand = READ_LONG();
+		goto setProperty;
+	TARGET(OP_SET_PROPERTY):
+		operand = READ_BYTE();
+	setProperty: {
+		ObjString* name = AS_STRING(constants[operand]);
+		InlineCache* cache = READ_CACHE();
+		if (!IS_INSTANCE(peek(1))) {
+			RUNTIME_ERROR("Only instances have fields.");
 		}
-		case OP_SET_GLOBAL: {
-			ObjString* name = READ_STRING();
-			if (tableSet(&vm.globals, name, peek(0))) {
-				tableDelete(&vm.globals, name);
-				runtimeError("Undefined variable '%s'", name->data);
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			break;
+		ObjInstance* instance = AS_INSTANCE(peek(1));
+		setProperty(instance, name, cache, peek(0));
+		Value value = pop();
+		pop();
+		push(value);
+		DISPATCH();
+	}
+	TARGET(OP_GET_INDEX): {
+		if (!IS_ARRAY(peek(1))) {
+			RUNTIME_ERROR("Can only index into arrays.");
 		}
-		case OP_GET_UPVALUE: {
-			uint8_t slot = READ_BYTE();
-			push(*frame->closure->upvalues[slot]->location);
-			break;
+		if (!isInteger(peek(0))) {
+			RUNTIME_ERROR("Index must be a nonnegative integer.");
 		}
-		case OP_SET_UPVALUE: {
-			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = peek(0);
-			break;
+		int index = (int)AS_NUMBER(peek(0));
+		ObjArray* array = AS_ARRAY(peek(1));
+		if (index < 0 || index + 1 > array->count) {
+			RUNTIME_ERROR("Index out of bounds: %d", index);
 		}
-		case OP_GET_PROPERTY: {
-			ObjString* name = READ_STRING();
-			if (IS_STRING(peek(0)) || IS_ARRAY(peek(0))) {
-				if (!strcmp(name->data, "length")) {
-					Value obj = pop(); // Obj.
-					push(NUMBER_VAL(IS_STRING(obj) ? AS_STRING(obj)->length : AS_ARRAY(obj)->count));
-				}
-				else {
-					runtimeError("%s have no property '%s'.", IS_STRING(peek(0)) ? "Strings" : "Arrays", name->data);
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				break;
-			}
-			if (!IS_INSTANCE(peek(0))) {
-				runtimeError("Only instances have properties.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			ObjInstance* instance = AS_INSTANCE(peek(0));
-			Value value;
-			if (tableGet(&instance->fields, name, &value)) {
-				pop(); // Instance.
-				push(value);
-				break;
-			}
-			if (!bindMethod(instance->cls, name)) {
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			break;
+		pop();
+		pop();
+		push(arrayValues(array)[index]);
+		DISPATCH();
+	}
+	TARGET(OP_SET_INDEX): {
+		if (!IS_ARRAY(peek(2))) {
+			RUNTIME_ERROR("Can only index into arrays.");
 		}
-		case OP_SET_PROPERTY: {
-			if (!IS_INSTANCE(peek(1))) {
-				runtimeError("Only instances have fields.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			ObjInstance* instance = AS_INSTANCE(peek(1));
-			tableSet(&instance->fields, READ_STRING(), peek(0));
-			Value value = pop();
-			pop();
-			push(value);
-			break;
+		if (!isInteger(peek(1))) {
+			RUNTIME_ERROR("Index must be a nonnegative integer.");
 		}
-		case OP_GET_INDEX: {
-			if (!IS_ARRAY(peek(1))) {
-				runtimeError("Can only index into arrays.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			if (!isInteger(peek(0))) {
-				runtimeError("Index must be a nonnegative integer.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			int index = (int)AS_NUMBER(peek(0));
-			ObjArray* array = AS_ARRAY(peek(1));
-			if (index < 0 || index + 1 > array->count) {
-				runtimeError("Index out of bounds: %d", index);
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			pop();
-			pop();
-			push(array->values[index]);
-			break;
+		int index = (int)AS_NUMBER(peek(1));
+		ObjArray* array = AS_ARRAY(peek(2));
+		if (index < 0 || index > array->count) {
+			RUNTIME_ERROR("Index out of bounds: %d", index);
 		}
-		case OP_SET_INDEX: {
-			if (!IS_ARRAY(peek(2))) {
-				runtimeError("Can only index into arrays.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			if (!isInteger(peek(1))) {
-				runtimeError("Index must be a nonnegative integer.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			int index = (int)AS_NUMBER(peek(1));
-			ObjArray* array = AS_ARRAY(peek(2));
-			if (index < 0 || index > array->count) {
-				runtimeError("Index out of bounds: %d", index);
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			if (array->capacity < array->count + 1) {
-				int oldCapacity = array->capacity;
-				array->capacity = GROW_CAPACITY(oldCapacity);
-				array->values = GROW_ARRAY(array->values, Value, oldCapacity, array->capacity);
-			}
-			if (index == array->count) {
-				array->count++;
-			}
-			array->values[index] = pop();
-			pop();
-			pop();
-			push(array->values[index]);
-			break;
+		if (index == array->count) {
+			lockHeap();
+			growArray(array, array->count + 1);
+			arrayValues(array)[array->count++] = peek(0);
+			unlockHeap();
 		}
-		case OP_GET_SUPER: {
-			ObjString* name = READ_STRING();
-			ObjClass* superclass = AS_CLASS(pop());
-			if (!bindMethod(superclass, name)) {
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			break;
+		else {
+			snapshotBarrier(arrayValues(array)[index]);
+			arrayValues(array)[index] = peek(0);
 		}
-		case OP_EQUAL: {
-			Value b = pop();
-			Value a = pop();
-			push(BOOL_VAL(valuesEqual(a, b)));
-			break;
+		writeBarrier((Obj*)array, peek(0));
+		Value value = pop();
+		pop();
+		pop();
+		push(value);
+		DISPATCH();
+	}
+	TARGET(OP_GET_SUPER_LONG):
+		operand = READ_LONG();
+		goto getSuper;
+	TARGET(OP_GET_SUPER):
+		operand = READ_BYTE();
+	getSuper: {
+		ObjString* name = AS_STRING(constants[operand]);
+		InlineCache* cache = READ_CACHE();
+		ObjClass* superclass = AS_CLASS(pop());
+		Value method;
+		if (!findMethod(superclass, name, cache, &method)) {
+			RUNTIME_ERROR("Undefined property '%s'.", name->data);
 		}
-		case OP_GREATER:
-			BINARY_OP(BOOL_VAL, > );
-			break;
-		case OP_LESS:
-			BINARY_OP(BOOL_VAL, < );
-			break;
-		case OP_ADD:
-			if (IS_STRING(peek(0)) || IS_STRING(peek(1))) {
-				vm.stackTop[-1] = OBJ_VAL(valueToString(peek(0)));
-				vm.stackTop[-2] = OBJ_VAL(valueToString(peek(1)));
-				concatenate();
-			}
-			else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-				double b = AS_NUMBER(pop());
-				double a = AS_NUMBER(pop());
-				push(NUMBER_VAL(a + b));
-			}
-			else {
-				runtimeError("Operands must be two numbers or at least one must be a string.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			break;
-		case OP_SUBTRACT:
-			BINARY_OP(NUMBER_VAL, -);
-			break;
-		case OP_MULTIPLY:
-			BINARY_OP(NUMBER_VAL, *);
-			break;
-		case OP_DIVIDE:
-			BINARY_OP(NUMBER_VAL, /);
-			break;
-		case OP_EXPONENTIATE:
-			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
-				runtimeError("Operands must be numbers.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
+		bindMethod(AS_CLOSURE(method));
+		DISPATCH();
+	}
+	TARGET(OP_EQUAL): {
+		Value b = pop();
+		Value a = pop();
+		if (IS_NUMBER(a) && IS_NUMBER(b)) {
+			QUICKEN(OP_EQUAL_NUMBER);
+		}
+		push(BOOL_VAL(valuesEqual(a, b)));
+		DISPATCH();
+	}
+	TARGET(OP_NOT_EQUAL): {
+		Value b = pop();
+		Value a = pop();
+		if (IS_NUMBER(a) && IS_NUMBER(b)) {
+			QUICKEN(OP_NOT_EQUAL_NUMBER);
+		}
+		push(BOOL_VAL(!valuesEqual(a, b)));
+		DISPATCH();
+	}
+	TARGET(OP_GREATER):
+		BINARY_OP(BOOL_VAL, >, OP_GREATER_NUMBER);
+		DISPATCH();
+	TARGET(OP_GREATER_EQUAL):
+		BINARY_OP(BOOL_VAL, >=, OP_GREATER_EQUAL_NUMBER);
+		DISPATCH();
+	TARGET(OP_LESS):
+		BINARY_OP(BOOL_VAL, <, OP_LESS_NUMBER);
+		DISPATCH();
+	TARGET(OP_LESS_EQUAL):
+		BINARY_OP(BOOL_VAL, <=, OP_LESS_EQUAL_NUMBER);
+		DISPATCH();
+	TARGET(OP_ADD):
+		if (IS_STRING(peek(0)) || IS_STRING(peek(1))) {
+			vm.stackTop[-1] = OBJ_VAL(valueToString(peek(0)));
+			vm.stackTop[-2] = OBJ_VAL(valueToString(peek(1)));
+			concatenate();
+		}
+		else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+			QUICKEN(OP_ADD_NUMBER);
 			double b = AS_NUMBER(pop());
 			double a = AS_NUMBER(pop());
-			push(NUMBER_VAL(pow(a, b)));
-			break;
-		case OP_NOT:
-			push(BOOL_VAL(isFalsey(pop())));
-			break;
-		case OP_NEGATE:
-			if (!IS_NUMBER(peek(0))) {
-				runtimeError("Operand must be a number.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			push(NUMBER_VAL(-AS_NUMBER(pop())));
-			break;
-		case OP_PRINT:
-			printValue(pop());
-			printf("\n");
-			break;
-		case OP_JUMP: {
-			uint8_t offset = READ_SHORT();
-			frame->ip += offset;
-			break;
+			push(NUMBER_VAL(a + b));
 		}
-		case OP_JUMP_IF_FALSE: {
-			uint8_t offset = READ_SHORT();
-			if (isFalsey(peek(0))) {
-				frame->ip += offset;
-			}
-			break;
+		else {
+			RUNTIME_ERROR("Operands must be two numbers or at least one must be a string.");
 		}
-		case OP_LOOP: {
-			uint16_t offset = READ_SHORT();
-			frame->ip -= offset;
-			break;
+		DISPATCH();
+	TARGET(OP_SUBTRACT):
+		BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUMBER);
+		DISPATCH();
+	TARGET(OP_MULTIPLY):
+		BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUMBER);
+		DISPATCH();
+	TARGET(OP_DIVIDE):
+		BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUMBER);
+		DISPATCH();
+	TARGET(OP_EXPONENTIATE): {
+		if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+			RUNTIME_ERROR("Operands must be numbers.");
 		}
-		case OP_CALL: {
-			int argCount = READ_BYTE();
-			if (!callValue(peek(argCount), argCount)) {
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			frame = &vm.frames[vm.frameCount - 1];
-			break;
+		double b = AS_NUMBER(pop());
+		double a = AS_NUMBER(pop());
+		push(NUMBER_VAL(pow(a, b)));
+		DISPATCH();
+	}
+	TARGET(OP_NOT):
+		push(BOOL_VAL(isFalsey(pop())));
+		DISPATCH();
+	TARGET(OP_NEGATE):
+		if (!IS_NUMBER(peek(0))) {
+			RUNTIME_ERROR("Operand must be a number.");
 		}
-		case OP_INVOKE: {
-			ObjString* method = READ_STRING();
-			int argCount = READ_BYTE();
-			if (!invoke(method, argCount)) {
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			frame = &vm.frames[vm.frameCount - 1];
-			break;
+		push(NUMBER_VAL(-AS_NUMBER(pop())));
+		DISPATCH();
+	TARGET(OP_PRINT):
+		printValue(pop());
+		printf("\n");
+		DISPATCH();
+	TARGET(OP_JUMP): {
+		uint16_t offset = READ_SHORT();
+		ip += offset;
+		DISPATCH();
+	}
+	TARGET(OP_JUMP_IF_FALSE): {
+		uint16_t offset = READ_SHORT();
+		if (isFalsey(peek(0))) {
+			ip += offset;
 		}
-		case OP_SUPER_INVOKE: {
-			ObjString* method = READ_STRING();
-			int argCount = READ_BYTE();
-			ObjClass* superclass = AS_CLASS(pop());
-			if (!invokeFromClass(superclass, method, argCount)) {
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			frame = &vm.frames[vm.frameCount - 1];
-			break;
+		DISPATCH();
+	}
+	TARGET(OP_POP_JUMP_IF_FALSE): {
+		uint16_t offset = READ_SHORT();
+		if (isFalsey(pop())) {
+			ip += offset;
 		}
-		case OP_CLOSURE: {
-			ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-			ObjClosure* closure = newClosure(function);
-			push(OBJ_VAL(closure));
-			for (int i = 0; i < closure->upvalueCount; i++) {
-				uint8_t isLocal = READ_BYTE();
-				uint8_t index = READ_BYTE();
-				if (isLocal) {
-					closure->upvalues[i] = captureUpvalue(frame->slots + index);
-				}
-				else {
-					closure->upvalues[i] = frame->closure->upvalues[index];
-				}
-			}
-			break;
+		DISPATCH();
+	}
+	TARGET(OP_EQUAL_JUMP): {
+		uint16_t offset = READ_SHORT();
+		Value b = pop();
+		if (!valuesEqual(pop(), b)) {
+			ip += offset;
 		}
-		case OP_CLOSE_UPVALUE:
-			closeUpvalues(vm.stackTop - 1);
-			pop();
-			break;
-		case OP_RETURN: {
-			Value result = pop();
-			closeUpvalues(frame->slots);
-			vm.frameCount--;
-			if (!vm.frameCount) {
-				pop();
-				return INTERPRET_OK;
-			}
-			vm.stackTop = frame->slots;
-			push(result);
-			frame = &vm.frames[vm.frameCount - 1];
-			break;
+		DISPATCH();
+	}
+	TARGET(OP_NOT_EQUAL_JUMP): {
+		uint16_t offset = READ_SHORT();
+		Value b = pop();
+		if (valuesEqual(pop(), b)) {
+			ip += offset;
 		}
-		case OP_CLASS:
-			push(OBJ_VAL(newClass(READ_STRING())));
-			break;
-		case OP_INHERIT: {
-			Value superclass = peek(1);
-			ObjClass* subclass = AS_CLASS(peek(0));
-			if (!IS_CLASS(superclass)) {
-				runtimeError("Superclass must be a class.");
+		DISPATCH();
+	}
+	TARGET(OP_GREATER_JUMP):
+		COMPARE_JUMP(>);
+		DISPATCH();
+	TARGET(OP_GREATER_EQUAL_JUMP):
+		COMPARE_JUMP(>=);
+		DISPATCH();
+	TARGET(OP_LESS_JUMP):
+		COMPARE_JUMP(<);
+		DISPATCH();
+	TARGET(OP_LESS_EQUAL_JUMP):
+		COMPARE_JUMP(<=);
+		DISPATCH();
+	TARGET(OP_LOOP): {
+		uint16_t offset = READ_SHORT();
+		ip -= offset;
+		SAFE_POINT();
+		DISPATCH();
+	}
+	TARGET(OP_CALL): {
+		SAFE_POINT();
+		int argCount = READ_BYTE();
+		STORE_FRAME();
+		if (!callValue(peek(argCount), argCount)) {
+			return INTERPRET_RUNTIME_ERROR;
+		}
+		LOAD_FRAME();
+		DISPATCH();
+	}
+	TARGET(OP_TAIL_CALL): {
+		SAFE_POINT();
+		int argCount = READ_BYTE();
+		Value callee = peek(argCount);
+		ObjClosure* closure = NULL;
+		if (IS_CLOSURE(callee)) {
+			closure = AS_CLOSURE(callee);
+		}
+		else if (IS_BOUND_METHOD(callee)) {
+			vm.stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+			closure = AS_BOUND_METHOD(callee)->method;
+		}
+		else {
+			// Natives and classes are called as usual; the OP_RETURN that
+			// follows hands back their result.
+			STORE_FRAME();
+			if (!callValue(callee, argCount)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-			pop();
-			break;
+			LOAD_FRAME();
+			DISPATCH();
 		}
-		case OP_METHOD:
-			defineMethod(READ_STRING());
-			break;
-		case OP_ARRAY: {
-			int length = READ_BYTE();
-			ObjArray* array = newArray();
-			while (array->count < length) {
-				if (array->capacity < array->count + 1) {
-					int oldCapacity = array->capacity;
-					array->capacity = GROW_CAPACITY(oldCapacity);
-					array->values = GROW_ARRAY(array->values, Value, oldCapacity, array->capacity);
-				}
-				array->values[array->count++] = peek(length - array->count - 1);
+		if (argCount != closure->function->arity) {
+			RUNTIME_ERROR("Expected %d arguments but got %d.", closure->function->arity, argCount);
+		}
+		if (closure->function->source && !compileBody(closure->function)) {
+			RUNTIME_ERROR("Could not compile %s().", closure->function->name->data);
+		}
+		if (!ensureStack(closure->function->slotCount + STACK_HEADROOM)) {
+			RUNTIME_ERROR("Stack overflow.");
+		}
+		// Reuse the current frame: slide the callee and its arguments down
+		// over it, as if it had returned and the call were made by its caller.
+		closeUpvalues(frame->slots);
+		memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+		vm.stackTop = frame->slots + argCount + 1;
+		frame->closure = closure;
+		ip = closure->function->chunk.code;
+		constants = closure->function->chunk.constants.values;
+		DISPATCH();
+	}
+	TARGET(OP_INVOKE): {
+		SAFE_POINT();
+		ObjString* method = READ_STRING();
+		int argCount = READ_BYTE();
+		InlineCache* cache = READ_CACHE();
+		STORE_FRAME();
+		if (!invoke(method, argCount, cache)) {
+			return INTERPRET_RUNTIME_ERROR;
+		}
+		LOAD_FRAME();
+		DISPATCH();
+	}
+	TARGET(OP_SUPER_INVOKE): {
+		SAFE_POINT();
+		ObjString* method = READ_STRING();
+		int argCount = READ_BYTE();
+		InlineCache* cache = READ_CACHE();
+		ObjClass* superclass = AS_CLASS(pop());
+		STORE_FRAME();
+		if (!invokeFromClass(superclass, method, argCount, cache)) {
+			return INTERPRET_RUNTIME_ERROR;
+		}
+		LOAD_FRAME();
+		DISPATCH();
+	}
+	TARGET(OP_CLOSURE_LONG):
+		operand = READ_LONG();
+		goto closure;
+	TARGET(OP_CLOSURE):
+		operand = READ_BYTE();
+	closure: {
+		ObjFunction* function = AS_FUNCTION(constants[operand]);
+		ObjClosure* closure = newClosure(function);
+		push(OBJ_VAL(closure));
+		for (int i = 0; i < closure->upvalueCount; i++) {
+			uint8_t flags = READ_BYTE();
+			int index = flags & UPVALUE_LONG ? READ_SHORT() : READ_BYTE();
+			if (flags & UPVALUE_LOCAL) {
+				closure->upvalues[i] = captureUpvalue(frame->slots + index);
 			}
-			for (int i = 0; i < length; i++) {
-				pop();
+			else {
+				closure->upvalues[i] = frame->closure->upvalues[index];
 			}
-			push(OBJ_VAL(array));
-			break;
 		}
+		DISPATCH();
+	}
+	TARGET(OP_CLOSE_UPVALUE):
+		closeUpvalues(vm.stackTop - 1);
+		pop();
+		DISPATCH();
+	TARGET(OP_RETURN): {
+		Value result = pop();
+		closeUpvalues(frame->slots);
+		vm.frameCount--;
+		if (!vm.frameCount) {
+			pop();
+			return INTERPRET_OK;
 		}
+		vm.stackTop = frame->slots;
+		push(result);
+		LOAD_FRAME();
+		SAFE_POINT();
+		DISPATCH();
 	}
+	TARGET(OP_CLASS):
+		push(OBJ_VAL(newClass(READ_STRING())));
+		DISPATCH();
+	TARGET(OP_CLASS_LONG):
+		push(OBJ_VAL(newClass(READ_STRING_LONG())));
+		DISPATCH();
+	TARGET(OP_INHERIT): {
+		Value superclass = peek(1);
+		ObjClass* subclass = AS_CLASS(peek(0));
+		if (!IS_CLASS(superclass)) {
+			RUNTIME_ERROR("Superclass must be a class.");
+		}
+		tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+		rememberObject((Obj*)subclass);
+		pop();
+		DISPATCH();
+	}
+	TARGET(OP_METHOD):
+		defineMethod(READ_STRING());
+		DISPATCH();
+	TARGET(OP_METHOD_LONG):
+		defineMethod(READ_STRING_LONG());
+		DISPATCH();
+	TARGET(OP_ARRAY): {
+		int length = READ_BYTE();
+		ObjArray* array = newArray();
+		push(OBJ_VAL(array));
+		appendElements(array, vm.stackTop - length - 1, length);
+		vm.stackTop -= length + 1;
+		push(OBJ_VAL(array));
+		DISPATCH();
+	}
+	TARGET(OP_ARRAY_APPEND): {
+		int length = READ_BYTE();
+		appendElements(AS_ARRAY(peek(length)), vm.stackTop - length, length);
+		vm.stackTop -= length;
+		DISPATCH();
+	}
+	TARGET(OP_EQUAL_NUMBER): {
+		Value b = peek(0);
+		Value a = peek(1);
+		if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+			DEOPTIMIZE(OP_EQUAL);
+		}
+		vm.stackTop[-2] = BOOL_VAL(cmpNumber(a, b));
+		vm.stackTop--;
+		DISPATCH();
+	}
+	TARGET(OP_NOT_EQUAL_NUMBER): {
+		Value b = peek(0);
+		Value a = peek(1);
+		if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+			DEOPTIMIZE(OP_NOT_EQUAL);
+		}
+		vm.stackTop[-2] = BOOL_VAL(!cmpNumber(a, b));
+		vm.stackTop--;
+		DISPATCH();
+	}
+	TARGET(OP_GREATER_NUMBER):
+		NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+		DISPATCH();
+	TARGET(OP_GREATER_EQUAL_NUMBER):
+		NUMBER_OP(BOOL_VAL, >=, OP_GREATER_EQUAL);
+		DISPATCH();
+	TARGET(OP_LESS_NUMBER):
+		NUMBER_OP(BOOL_VAL, <, OP_LESS);
+		DISPATCH();
+	TARGET(OP_LESS_EQUAL_NUMBER):
+		NUMBER_OP(BOOL_VAL, <=, OP_LESS_EQUAL);
+		DISPATCH();
+	TARGET(OP_ADD_NUMBER):
+		NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+		DISPATCH();
+	TARGET(OP_SUBTRACT_NUMBER):
+		NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
+		DISPATCH();
+	TARGET(OP_MULTIPLY_NUMBER):
+		NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY);
+		DISPATCH();
+	TARGET(OP_DIVIDE_NUMBER):
+		NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+		DISPATCH();
+	}
+	return INTERPRET_RUNTIME_ERROR; // Unknown opcode.
+#undef LOAD_FRAME
+#undef STORE_FRAME
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_STRING_LONG
+#undef READ_CACHE
+#undef RUNTIME_ERROR
+#undef QUICKEN
+#undef DEOPTIMIZE
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef COMPARE_JUMP
+#undef SAFE_POINT
+#undef TRACE_EXECUTION
+#undef PROFILE_OPCODE
+#undef INTERPRET_LOOP
+#undef TARGET
+#undef DISPATCH
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+void traceExecution(CallFrame* frame, uint8_t* ip) {
+	printf("          ");
+	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+		printf("[ ");
+		printValue(*slot);
+		printf(" ]");
+	}
+	printf("\n");
+	disassembleInstruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
+}
+#endif // DEBUG_TRACE_EXECUTION
+
 void push(Value value) {
 	*vm.stackTop++ = value;
 }
@@ -479,48 +1011,15 @@ Value peek(int distance) {
 void concatenate() {
 	ObjString* b = AS_STRING(peek(0));
 	ObjString* a = AS_STRING(peek(1));
-	int length = a->length + b->length;
-	char* data = ALLOCATE(char, length + 1);
-	memcpy(data, a->data, a->length);
-	memcpy(data + a->length, b->data, b->length);
-	data[length] = '\0';
-	ObjString* string = takeString(data, length);
+	ObjString* string = newString(a->length + b->length);
+	memcpy(string->data, a->data, a->length);
+	memcpy(string->data + a->length, b->data, b->length);
+	string = internString(string);
 	pop();
 	pop();
 	push(OBJ_VAL(string));
 }
 
-bool isFalsey(Value value) { // TODO move this to value.c
-    if (IS_BOOL(value)) {
-        return !AS_BOOL(value);
-    }
-    else if (IS_NIL(value)) {
-        return true;
-    }
-    else if (IS_NUMBER(value)) {
-        return !AS_NUMBER(value);
-    }
-    else if (IS_OBJ(value)) { 
-		switch (AS_OBJ(value)->type) {
-		case OBJ_STRING:
-			return !strcmp(AS_CSTRING(value), "");
-		case OBJ_NATIVE:
-		case OBJ_FUNCTION:
-		case OBJ_CLOSURE:
-		case OBJ_CLASS:
-		case OBJ_BOUND_METHOD:
-		case OBJ_INSTANCE:
-			return false;
-		case OBJ_ARRAY:
-			return !AS_ARRAY(value)->count;
-		default:
-			break;
-		}
-    }
-    else {
-        return true; // TODO need internal error logic
-    }
-}
 
 ObjUpvalue* captureUpvalue(Value* local) {
 	ObjUpvalue* prev = NULL;
@@ -549,6 +1048,7 @@ void closeUpvalues(Value* last) {
 		ObjUpvalue* upvalue = vm.openUpvalues;
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
+		writeBarrier((Obj*)upvalue, upvalue->closed);
 		vm.openUpvalues = upvalue->next;
 	}
 }
@@ -556,20 +1056,127 @@ void closeUpvalues(Value* last) {
 void defineMethod(ObjString* name) {
 	Value method = peek(0);
 	ObjClass* cls = AS_CLASS(peek(1));
+	Value old;
+	if (tableGet(&cls->methods, name, &old)) {
+		snapshotBarrier(old);
+	}
 	tableSet(&cls->methods, name, method);
+	writeBarrier((Obj*)cls, OBJ_VAL(name));
+	writeBarrier((Obj*)cls, method);
 	pop();
 }
 
-bool bindMethod(ObjClass* cls, ObjString* name) {
-	Value method;
-	if (!tableGet(&cls->methods, name, &method)) {
-		runtimeError("Undefined property '%s'.", name->data);
-		return false;
+// The elements stay on the stack, and so reachable, until they are copied.
+void appendElements(ObjArray* array, Value* elements, int count) {
+	lockHeap();
+	growArray(array, array->count + count);
+	Value* values = arrayValues(array);
+	for (int i = 0; i < count; i++) {
+		writeBarrier((Obj*)array, elements[i]);
+		values[array->count++] = elements[i];
+	}
+	unlockHeap();
+}
+
+CacheEntry* probeCache(InlineCache* cache, Obj* key) {
+	for (int i = 0; i < cache->count; i++) {
+		if (cache->entries[i].key == key) {
+			vm.cacheHits++;
+			return &cache->entries[i];
+		}
+	}
+	vm.cacheMisses++;
+	return NULL;
+}
+
+CacheEntry* fillCache(InlineCache* cache, Obj* key, Obj* target, int slot) {
+	// Once every way is taken the site is megamorphic; evict round-robin.
+	int way = cache->count < CACHE_WAYS ? cache->count : (int)(vm.cacheMisses % CACHE_WAYS);
+	CacheEntry* entry = &cache->entries[way];
+	lockHeap();
+	if (way < cache->count) {
+		snapshotBarrier(OBJ_VAL(entry->key));
+		snapshotBarrier(OBJ_VAL(entry->target));
 	}
-	ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+	entry->key = key;
+	entry->target = target;
+	entry->slot = slot;
+	if (way == cache->count) {
+		cache->count++;
+	}
+	unlockHeap();
+	// Caches are only filled for the running function.
+	Obj* function = (Obj*)vm.frames[vm.frameCount - 1].closure->function;
+	writeBarrier(function, OBJ_VAL(key));
+	writeBarrier(function, OBJ_VAL(target));
+	return entry;
+}
+
+CacheEntry* findProperty(ObjInstance* instance, ObjString* name, InlineCache* cache) {
+	ObjShape* shape = instance->shape;
+	CacheEntry* entry = probeCache(cache, (Obj*)shape);
+	if (entry) {
+		return entry;
+	}
+	int slot = shapeSlot(shape, name);
+	Value method = NIL_VAL;
+	if (slot < 0 && !tableGet(&shape->cls->methods, name, &method)) {
+		return NULL;
+	}
+	return fillCache(cache, (Obj*)shape, slot < 0 ? AS_OBJ(method) : NULL, slot);
+}
+
+void setProperty(ObjInstance* instance, ObjString* name, InlineCache* cache, Value value) {
+	ObjShape* shape = instance->shape;
+	CacheEntry* entry = probeCache(cache, (Obj*)shape);
+	if (!entry) {
+		int slot = shapeSlot(shape, name);
+		ObjShape* next = NULL;
+		if (slot < 0) {
+			next = shapeTransition(shape, name);
+			slot = shape->count;
+		}
+		entry = fillCache(cache, (Obj*)shape, (Obj*)next, slot);
+	}
+	writeBarrier((Obj*)instance, value);
+	if (entry->target) {
+		lockHeap();
+		growFields(instance, entry->slot + 1);
+		*instanceSlot(instance, entry->slot) = value;
+		instance->shape = (ObjShape*)entry->target;
+		unlockHeap();
+		writeBarrier((Obj*)instance, OBJ_VAL(entry->target));
+		return;
+	}
+	snapshotBarrier(*instanceSlot(instance, entry->slot));
+	*instanceSlot(instance, entry->slot) = value;
+}
+
+void growFields(ObjInstance* instance, int count) {
+	int needed = count - INSTANCE_INLINE_FIELDS;
+	if (needed > instance->capacity) {
+		int oldCapacity = instance->capacity;
+		instance->capacity = GROW_CAPACITY(oldCapacity);
+		instance->fields = GROW_ARRAY(instance->fields, Value, oldCapacity, instance->capacity);
+	}
+}
+
+bool findMethod(ObjClass* cls, ObjString* name, InlineCache* cache, Value* method) {
+	CacheEntry* entry = probeCache(cache, (Obj*)cls);
+	if (!entry) {
+		if (!tableGet(&cls->methods, name, method)) {
+			return false;
+		}
+		entry = fillCache(cache, (Obj*)cls, AS_OBJ(*method), -1);
+	}
+	*method = OBJ_VAL(entry->target);
+	return true;
+}
+
+void bindMethod(ObjClosure* method) {
+	ObjBoundMethod* bound = newBoundMethod(peek(0), method);
 	pop();
 	push(OBJ_VAL(bound));
-	return true;
 }
 
 bool callValue(Value callee, int argCount) {
@@ -616,7 +1223,25 @@ bool call(ObjClosure* closure, int argCount) {
 		runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
 		return false;
 	}
-	if (vm.frameCount == FRAMES_MAX) {
+	if (closure->function->source && !compileBody(closure->function)) {
+		runtimeError("Could not compile %s().", closure->function->name->data);
+		return false;
+	}
+	if (vm.frameCount == vm.framesMax) {
+		runtimeError("Stack overflow.");
+		return false;
+	}
+	if (vm.frameCount == vm.frameCapacity) {
+		int capacity = GROW_CAPACITY(vm.frameCapacity);
+		CallFrame* frames = GROW_ARRAY(vm.frames, CallFrame, vm.frameCapacity, capacity);
+		if (!frames) {
+			runtimeError("Stack overflow.");
+			return false;
+		}
+		vm.frames = frames;
+		vm.frameCapacity = capacity;
+	}
+	if (!ensureStack(closure->function->slotCount + STACK_HEADROOM)) {
 		runtimeError("Stack overflow.");
 		return false;
 	}
@@ -627,24 +1252,29 @@ bool call(ObjClosure* closure, int argCount) {
 	return true;
 }
 
-bool invoke(ObjString* name, int argCount) {
+bool invoke(ObjString* name, int argCount, InlineCache* cache) {
 	Value receiver = peek(argCount);
 	if (!IS_INSTANCE(receiver)) {
 		runtimeError("Only instances have methods.");
 		return false;
 	}
-	Value value;
 	ObjInstance* instance = AS_INSTANCE(receiver);
-	if (tableGet(&instance->fields, name, &value)) {
+	CacheEntry* entry = findProperty(instance, name, cache);
+	if (!entry) {
+		runtimeError("Undefined property '%s'.", name->data);
+		return false;
+	}
+	if (entry->slot >= 0) {
+		Value value = *instanceSlot(instance, entry->slot);
 		vm.stackTop[-argCount - 1] = value;
 		return callValue(value, argCount);
 	}
-	return invokeFromClass(instance->cls, name, argCount);
+	return call((ObjClosure*)entry->target, argCount);
 }
 
-bool invokeFromClass(ObjClass* cls, ObjString* name, int argCount) {
+bool invokeFromClass(ObjClass* cls, ObjString* name, int argCount, InlineCache* cache) {
 	Value method;
-	if (!tableGet(&cls->methods, name, &method)) {
+	if (!findMethod(cls, name, cache, &method)) {
 		runtimeError("Undefined property '%s'.", name->data);
 		return false;
 	}
@@ -659,10 +1289,16 @@ void runtimeError(const char* format, ...) {
 	va_end(args);
 	fputs("\n", stderr);
 	for (int i = vm.frameCount - 1; i >= 0; i--) {
+		// Deep recursion would bury the error, so only the ends of the trace
+		// are printed.
+		if (i == vm.frameCount - TRACE_ENDS - 1 && i >= TRACE_ENDS) {
+			fprintf(stderr, "[... %d more frames]\n", i - TRACE_ENDS + 1);
+			i = TRACE_ENDS - 1;
+		}
 		CallFrame* frame = &vm.frames[i];
 		ObjFunction* function = frame->closure->function;
 		size_t instruction = frame->ip - function->chunk.code - 1;
-		fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+		fprintf(stderr, "[line %d] in ", getLine(&function->chunk, (int)instruction));
 		if (!function->name) {
 			fprintf(stderr, "script\n");
 		}
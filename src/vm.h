@@ -1,12 +1,16 @@
 #pragma once
 
 #include "chunk.h"
+#include "heap.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 0x40
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define DEFAULT_FRAMES_MAX 0x10000
+// Room guaranteed on the stack beyond the most a frame's code uses, for what
+// the interpreter pushes itself.
+#define STACK_HEADROOM (UINT8_COUNT * 2)
+#define GC_THREADS_MAX 64
 
 typedef enum {
 	INTERPRET_OK,
@@ -14,6 +18,12 @@ typedef enum {
 	INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
+typedef enum {
+	GC_IDLE,
+	GC_MARK,
+	GC_SWEEP
+} GCPhase;
+
 typedef struct {
 	ObjClosure* closure;
 	uint8_t* ip;
@@ -21,27 +31,62 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-	CallFrame frames[FRAMES_MAX];
+	CallFrame* frames;
 	int frameCount;
-	Value stack[STACK_MAX]; // TODO need to handle stack overflow
+	int frameCapacity;
+	int framesMax;
+	bool lazyCompile;
+	bool wideGlobals; // Whether global operands are always given the long form.
+	Value* stack;
 	Value* stackTop;
-	Table globals;
+	int stackCapacity;
+	Table globalSlots;
+	ValueArray globals;
 	Table strings;
 	ObjString* initString;
 	ObjUpvalue* openUpvalues;
 	size_t bytesAllocated;
 	size_t nextGC;
-	Obj* objects;
+	int gcOverhead; // How far past what survived the last collection, in percent, the heap may grow.
+	size_t heapLimit; // Past which a script fails, if collecting cannot keep it under. 0 for none.
+	double survivalRatio; // Of the heap when recent collections began, the share that survived them.
+	double allocationRate; // Bytes allocated during recent collections for each that survived them.
+	GCPhase gcPhase;
+	bool markBit; // What a marked object's bit is set to by this collection.
+	int gcStepWork; // Objects marked or swept by each step of a collection.
+	double gcPause; // The longest step of the collection under way, in seconds.
+	double maxPause; // The longest step of the last one.
+	int sweepClass;
+	Page* sweepPage; // The next to be swept.
+	int gcThreads; // How many threads mark and sweep when a collection is done at once.
+	bool concurrentGC; // Whether marking is left to a thread of its own.
+	bool markerActive; // Whether that thread is marking now.
+	int heapLocks;
+	size_t cacheHits;
+	size_t cacheMisses;
+	SizeClass heap[HEAP_CLASSES]; // The old generation.
+	uint8_t* nursery;
+	uint8_t* nurseryTop;
+	uint8_t* nurseryLimit; // Past this, collect at the next safe point.
+	int rememberedCount;
+	int rememberedCapacity;
+	Obj** remembered;
 	int grayCount;
 	int grayCapacity;
 	Obj** grayStack;
+	int overwrittenCount;
+	int overwrittenCapacity;
+	Obj** overwritten;
 } VM;
 
 void initVM();
 void freeVM();
+int globalSlot(ObjString*);
+ObjString* globalName(int);
 
-VM vm;
+extern VM vm;
 
 InterpretResult interpret(const char*);
+InterpretResult interpretFunction(ObjFunction*);
 void push(Value);
 Value pop();